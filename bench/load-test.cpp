@@ -0,0 +1,338 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// This is a load generator for the csp-web-api plugin. It sends requests to a running CosmoScout VR
+// instance from several threads concurrently and reports the throughput and the latency of each
+// endpoint. Before and after the run, the /metrics endpoint of the plugin is queried in order to
+// report the time the plugin spent on the main thread per frame.
+//
+// This tool does not host the plugin itself. The plugin depends on the GL context, the Vista frame
+// loop and the GUI of a full CosmoScout VR instance, which cannot be replaced by a mock core
+// without large changes to Plugin.cpp. Therefore, it requires a running instance with the plugin
+// loaded and fails if /metrics cannot be reached. This makes it a tool for manual measurements on a
+// workstation; it cannot run in a headless CI environment.
+//
+// Usage: csp-web-api-load-test [--host localhost] [--port 9001] [--duration 10] [--connections 4]
+//                              [--endpoints log,run-js,save,capture]
+//
+// The --connections parameter gives the number of concurrent connections per endpoint. Each
+// request uses a new connection, as the client API of civetweb does not support keep-alive.
+
+#include <civetweb.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Options {
+  std::string              mHost        = "localhost";
+  int                      mPort        = 9001;
+  double                   mDuration    = 10.0;
+  int                      mConnections = 4;
+  std::vector<std::string> mEndpoints   = {"log", "run-js", "save", "capture"};
+};
+
+struct Request {
+  std::string mMethod;
+  std::string mPath;
+  std::string mBody;
+};
+
+struct Response {
+  int         mStatus = 0;
+  std::string mBody;
+};
+
+struct Results {
+  std::vector<double> mLatencies;
+  uint64_t            mErrors = 0;
+};
+
+// The sum and the count of each section histogram of the /metrics endpoint.
+using SectionTimes = std::map<std::string, std::pair<double, double>>;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::map<std::string, Request> const REQUESTS{
+    {"log", {"GET", "/log?length=100", ""}},
+    {"run-js", {"POST", "/run-js", "document.title"}},
+    {"save", {"GET", "/save", ""}},
+    {"capture", {"GET", "/capture?width=320&height=240", ""}},
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::string> split(std::string const& value, char separator) {
+  std::vector<std::string> result;
+  std::stringstream        stream(value);
+  std::string              item;
+  while (std::getline(stream, item, separator)) {
+    if (!item.empty()) {
+      result.push_back(item);
+    }
+  }
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i(1); i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--help" || i + 1 >= argc) {
+      return false;
+    }
+
+    std::string value = argv[++i];
+
+    if (arg == "--host") {
+      options.mHost = value;
+    } else if (arg == "--port") {
+      options.mPort = std::stoi(value);
+    } else if (arg == "--duration") {
+      options.mDuration = std::stod(value);
+    } else if (arg == "--connections") {
+      options.mConnections = std::max(1, std::stoi(value));
+    } else if (arg == "--endpoints") {
+      options.mEndpoints = split(value, ',');
+    } else {
+      return false;
+    }
+  }
+
+  for (auto const& endpoint : options.mEndpoints) {
+    if (REQUESTS.find(endpoint) == REQUESTS.end()) {
+      std::cerr << "Unknown endpoint '" << endpoint << "'!" << std::endl;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Sends a single request and reads the entire response. Returns false on network errors.
+bool send(Options const& options, Request const& request, Response& response) {
+  std::array<char, 256> error{};
+
+  mg_connection* conn =
+      mg_connect_client(options.mHost.c_str(), options.mPort, 0, error.data(), error.size());
+
+  if (!conn) {
+    return false;
+  }
+
+  mg_printf(conn,
+      "%s %s HTTP/1.1\r\nHost: %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+      "Connection: close\r\n\r\n",
+      request.mMethod.c_str(), request.mPath.c_str(), options.mHost.c_str(), request.mBody.size());
+  mg_write(conn, request.mBody.data(), request.mBody.size());
+
+  if (mg_get_response(conn, error.data(), error.size(), 60000) < 0) {
+    mg_close_connection(conn);
+    return false;
+  }
+
+  response.mStatus = mg_get_response_info(conn)->status_code;
+  response.mBody.clear();
+
+  std::array<char, 16384> buffer{};
+  int                     read = 0;
+  while ((read = mg_read(conn, buffer.data(), buffer.size())) > 0) {
+    response.mBody.append(buffer.data(), read);
+  }
+
+  mg_close_connection(conn);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Retrieves the section_duration_seconds histograms from the /metrics endpoint.
+bool getSectionTimes(Options const& options, SectionTimes& times) {
+  Response response;
+  if (!send(options, {"GET", "/metrics", ""}, response) || response.mStatus != 200) {
+    return false;
+  }
+
+  std::string const prefix = "csp_web_api_section_duration_seconds_";
+  std::string const label  = "{section=\"";
+
+  std::stringstream stream(response.mBody);
+  std::string       line;
+  while (std::getline(stream, line)) {
+    if (line.compare(0, prefix.size(), prefix) != 0) {
+      continue;
+    }
+
+    auto labelStart = line.find(label);
+    auto labelEnd   = line.find("\"}", labelStart);
+    if (labelStart == std::string::npos || labelEnd == std::string::npos) {
+      continue;
+    }
+
+    auto   kind    = line.substr(prefix.size(), labelStart - prefix.size());
+    auto   section = line.substr(labelStart + label.size(), labelEnd - labelStart - label.size());
+    double value   = std::stod(line.substr(labelEnd + 2));
+
+    if (kind == "sum") {
+      times[section].first = value;
+    } else if (kind == "count") {
+      times[section].second = value;
+    }
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+double getPercentile(std::vector<double> const& sorted, double percentile) {
+  if (sorted.empty()) {
+    return 0.0;
+  }
+  auto index = static_cast<size_t>(percentile * static_cast<double>(sorted.size() - 1));
+  return sorted[index];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    std::cout << "Usage: " << argv[0]
+              << " [--host localhost] [--port 9001] [--duration 10] [--connections 4]"
+                 " [--endpoints log,run-js,save,capture]"
+              << std::endl;
+    return 1;
+  }
+
+  mg_init_library(0);
+
+  SectionTimes before;
+  if (!getSectionTimes(options, before)) {
+    std::cerr << "Failed to query http://" << options.mHost << ":" << options.mPort
+              << "/metrics! Is CosmoScout VR running with the csp-web-api plugin?" << std::endl;
+    mg_exit_library();
+    return 1;
+  }
+
+  std::map<std::string, Results> results;
+  std::mutex                      resultsMutex;
+  std::atomic<bool>               stop{false};
+  std::vector<std::thread>        threads;
+
+  for (auto const& endpoint : options.mEndpoints) {
+    for (int i(0); i < options.mConnections; ++i) {
+      threads.emplace_back([&, endpoint]() {
+        auto const& request = REQUESTS.at(endpoint);
+        Results     local;
+        Response    response;
+
+        while (!stop) {
+          auto start = std::chrono::steady_clock::now();
+          bool ok    = send(options, request, response);
+          auto end   = std::chrono::steady_clock::now();
+
+          if (ok && response.mStatus == 200) {
+            local.mLatencies.push_back(std::chrono::duration<double>(end - start).count());
+          } else {
+            ++local.mErrors;
+          }
+        }
+
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        auto&                       total = results[endpoint];
+        total.mLatencies.insert(
+            total.mLatencies.end(), local.mLatencies.begin(), local.mLatencies.end());
+        total.mErrors += local.mErrors;
+      });
+    }
+  }
+
+  std::this_thread::sleep_for(std::chrono::duration<double>(options.mDuration));
+  stop = true;
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  SectionTimes after;
+  bool         haveMetrics = getSectionTimes(options, after);
+
+  mg_exit_library();
+
+  // Print the client-side statistics of each endpoint.
+  std::cout << std::fixed << std::setprecision(2);
+  std::cout << std::left << std::setw(10) << "endpoint" << std::right << std::setw(10)
+            << "requests" << std::setw(10) << "errors" << std::setw(10) << "req/s"
+            << std::setw(12) << "p50 [ms]" << std::setw(12) << "p99 [ms]" << std::endl;
+
+  for (auto& result : results) {
+    auto& latencies = result.second.mLatencies;
+    std::sort(latencies.begin(), latencies.end());
+
+    std::cout << std::left << std::setw(10) << result.first << std::right << std::setw(10)
+              << latencies.size() << std::setw(10) << result.second.mErrors << std::setw(10)
+              << static_cast<double>(latencies.size()) / options.mDuration << std::setw(12)
+              << getPercentile(latencies, 0.5) * 1000.0 << std::setw(12)
+              << getPercentile(latencies, 0.99) * 1000.0 << std::endl;
+  }
+
+  if (!haveMetrics) {
+    std::cerr << "Failed to query /metrics after the run!" << std::endl;
+    return 1;
+  }
+
+  // Print the time spent on the main thread per frame. The update section covers the plugin's
+  // whole update and is recorded once per frame, so its count is the number of frames and its sum
+  // the total time. The other sections are parts of it; run-js, load, patch and most of save are
+  // in turn parts of the tasks section.
+  double frames = after["update"].second - before["update"].second;
+  if (frames <= 0.0) {
+    std::cerr << "No frames were rendered during the run!" << std::endl;
+    return 1;
+  }
+
+  double total = (after["update"].first - before["update"].first) / frames;
+
+  std::cout << std::endl
+            << "main-thread time per frame over " << static_cast<uint64_t>(frames)
+            << " frames:" << std::endl;
+  for (auto const& section : after) {
+    if (section.first == "encode" || section.first == "update") {
+      continue;
+    }
+
+    double time = (section.second.first - before[section.first].first) / frames;
+    std::cout << std::left << std::setw(10) << section.first << std::right << std::setw(12)
+              << time * 1000.0 << " ms" << std::endl;
+  }
+
+  std::cout << std::left << std::setw(10) << "total" << std::right << std::setw(12)
+            << total * 1000.0 << " ms" << std::endl;
+
+  return 0;
+}
@@ -0,0 +1,214 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// These benchmarks measure the parts of the csp-web-api plugin which do not require a running
+// CosmoScout VR instance: The log buffer and the image encoders. They use synthetic data and print
+// the average time per operation. For comparison, the log message hook which was used before the
+// LogBuffer was introduced is measured as well.
+//
+// Usage: csp-web-api-micro-bench [--width 1920] [--height 1080] [--iterations 20]
+
+#include "../src/ImageEncoder.hpp"
+#include "../src/LogBuffer.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Calls the given function the given number of times and prints the average duration. The
+// returned value of the function is printed as well, this can be used to report output sizes.
+void run(std::string const& name, int iterations, std::function<size_t()> const& function) {
+  size_t output = 0;
+  auto   start  = std::chrono::steady_clock::now();
+
+  for (int i(0); i < iterations; ++i) {
+    output = function();
+  }
+
+  auto   end  = std::chrono::steady_clock::now();
+  double time = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+
+  std::cout << std::left << std::setw(24) << name << std::right << std::fixed
+            << std::setprecision(3) << std::setw(14) << time << " us/op" << std::setw(14)
+            << output << std::endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Creates an RGB image with smooth gradients and some noise, as a rough approximation of a
+// rendered frame.
+std::vector<std::byte> createColorImage(int32_t width, int32_t height) {
+  std::vector<std::byte> pixels(static_cast<size_t>(width) * height * 3);
+  uint32_t               random = 1;
+
+  for (int32_t y(0); y < height; ++y) {
+    for (int32_t x(0); x < width; ++x) {
+      random    = random * 1664525U + 1013904223U;
+      auto* rgb = pixels.data() + (static_cast<size_t>(y) * width + x) * 3;
+      rgb[0]    = static_cast<std::byte>(x * 255 / width);
+      rgb[1]    = static_cast<std::byte>(y * 255 / height);
+      rgb[2]    = static_cast<std::byte>((random >> 24U) & 0x0fU);
+    }
+  }
+
+  return pixels;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::byte> createDepthImage(int32_t width, int32_t height) {
+  std::vector<std::byte> pixels(static_cast<size_t>(width) * height * sizeof(float));
+  auto*                  depth = reinterpret_cast<float*>(pixels.data());
+
+  for (int32_t y(0); y < height; ++y) {
+    for (int32_t x(0); x < width; ++x) {
+      depth[static_cast<size_t>(y) * width + x] =
+          0.5F + 0.5F * std::sin(static_cast<float>(x + y) * 0.01F);
+    }
+  }
+
+  return pixels;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// This is the log message hook of the plugin before the LogBuffer was introduced. Each message
+// looked up its level in a map and allocated a formatted string which was pushed to a deque.
+class LegacyLogSink {
+ public:
+  void add(std::string const& logger, spdlog::level::level_enum level, std::string const& message) {
+    const std::unordered_map<spdlog::level::level_enum, std::string> mapping = {
+        {spdlog::level::trace, "T"}, {spdlog::level::debug, "D"}, {spdlog::level::info, "I"},
+        {spdlog::level::warn, "W"}, {spdlog::level::err, "E"}, {spdlog::level::critical, "C"}};
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMessages.push_front("[" + mapping.at(level) + "] " + logger + message);
+
+    if (mMessages.size() > 1000) {
+      mMessages.pop_back();
+    }
+  }
+
+ private:
+  std::mutex              mMutex;
+  std::deque<std::string> mMessages;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+int main(int argc, char** argv) {
+  int32_t width      = 1920;
+  int32_t height     = 1080;
+  int     iterations = 20;
+
+  for (int i(1); i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--width") == 0) {
+      width = std::stoi(argv[i + 1]);
+    } else if (std::strcmp(argv[i], "--height") == 0) {
+      height = std::stoi(argv[i + 1]);
+    } else if (std::strcmp(argv[i], "--iterations") == 0) {
+      iterations = std::stoi(argv[i + 1]);
+    }
+  }
+
+  std::cout << std::left << std::setw(24) << "benchmark" << std::right << std::setw(20) << "time"
+            << std::setw(14) << "output" << std::endl;
+
+  // The log buffer. This is the same capacity as used by the plugin. The legacy sink shows the
+  // per-message cost before the LogBuffer was introduced.
+  csp::webapi::LogBuffer logBuffer(1000);
+  LegacyLogSink          legacySink;
+  std::string const      logger  = "cs-core";
+  std::string const      message = "Loaded 42 textures for 'Earth' in 1.234 seconds.";
+
+  run("legacy log sink", 100000, [&]() {
+    legacySink.add(logger, spdlog::level::info, message);
+    return 0;
+  });
+
+  run("LogBuffer::add", 100000, [&]() {
+    logBuffer.add(logger, spdlog::level::info, message);
+    return 0;
+  });
+
+  run("LogBuffer::getLatest", 1000, [&]() { return logBuffer.getLatest(1000).size(); });
+
+  run("LogBuffer::getSince", 1000, [&]() {
+    uint64_t cursor = 0;
+    return logBuffer.getSince(cursor, 1000, spdlog::level::info, "core").size();
+  });
+
+  run("LogBuffer to json", 1000, [&]() {
+    return nlohmann::json(logBuffer.getLatest(1000)).dump().size();
+  });
+
+  // The image encoders.
+  auto color = createColorImage(width, height);
+  auto depth = createDepthImage(width, height);
+
+  uint32_t threadCount = std::max(1U, std::thread::hardware_concurrency());
+
+  run("encodePNG", iterations,
+      [&]() { return csp::webapi::encodePNG(color.data(), width, height).size(); });
+
+  run("encodePNG parallel", iterations, [&]() {
+    return csp::webapi::encodePNG(
+        color.data(), width, height, csp::webapi::DEFAULT_PNG_COMPRESSION, threadCount)
+        .size();
+  });
+
+  run("encodePNG level 0", iterations, [&]() {
+    return csp::webapi::encodePNG(color.data(), width, height, 0, threadCount).size();
+  });
+
+  run("encodeQOI", iterations,
+      [&]() { return csp::webapi::encodeQOI(color.data(), width, height).size(); });
+
+  run("encodeQOI parallel", iterations,
+      [&]() { return csp::webapi::encodeQOI(color.data(), width, height, threadCount).size(); });
+
+  run("encodeRaw parallel", iterations,
+      [&]() { return csp::webapi::encodeRaw(color.data(), width, height, threadCount).size(); });
+
+  run("encodeJPEG", iterations,
+      [&]() { return csp::webapi::encodeJPEG(color.data(), width, height, 80).size(); });
+
+  run("encodeDepthTIFF", iterations,
+      [&]() { return csp::webapi::encodeDepthTIFF(depth.data(), width, height, 1.F).size(); });
+
+  using csp::webapi::DepthFormat;
+  using csp::webapi::TIFFCompression;
+
+  run("encodeDepthTIFF float16", iterations, [&]() {
+    return csp::webapi::encodeDepthTIFF(
+        depth.data(), width, height, 1.F, DepthFormat::eFloat16)
+        .size();
+  });
+
+  run("encodeDepthTIFF fixed16", iterations, [&]() {
+    return csp::webapi::encodeDepthTIFF(
+        depth.data(), width, height, 1.F, DepthFormat::eFixed16, TIFFCompression::eDeflate)
+        .size();
+  });
+
+  return 0;
+}
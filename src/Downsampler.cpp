@@ -0,0 +1,137 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Downsampler.hpp"
+
+#include "logger.hpp"
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Downsampler::Downsampler() {
+  glGenFramebuffers(1, &mFramebuffer);
+  glGenRenderbuffers(1, &mColor);
+  glGenRenderbuffers(1, &mDepth);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Downsampler::~Downsampler() {
+  glDeleteFramebuffers(1, &mFramebuffer);
+  glDeleteRenderbuffers(1, &mColor);
+  glDeleteRenderbuffers(1, &mDepth);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Downsampler::begin(bool depth, int32_t x, int32_t y, int32_t width, int32_t height,
+    int32_t targetWidth, int32_t targetHeight) {
+
+  GLint previousDraw = 0;
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &mPreviousRead);
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousDraw);
+
+  GLenum depthFormat = depth ? getDepthFormat() : 0;
+
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, mFramebuffer);
+
+  // The renderbuffers are only reallocated if the size or the format changed. The color buffer is
+  // always attached, so that the framebuffer is complete for reading in any case.
+  if (mWidth != targetWidth || mHeight != targetHeight) {
+    glBindRenderbuffer(GL_RENDERBUFFER, mColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, targetWidth, targetHeight);
+    glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, mColor);
+    mWidth  = targetWidth;
+    mHeight = targetHeight;
+  }
+
+  if (depth && (mDepthWidth != targetWidth || mDepthHeight != targetHeight ||
+                   mDepthFormat != depthFormat)) {
+    glBindRenderbuffer(GL_RENDERBUFFER, mDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, depthFormat, targetWidth, targetHeight);
+    mDepthWidth  = targetWidth;
+    mDepthHeight = targetHeight;
+    mDepthFormat = depthFormat;
+  }
+
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  // Depth-stencil formats have to be attached to both attachment points.
+  bool   stencil    = depthFormat == GL_DEPTH24_STENCIL8 || depthFormat == GL_DEPTH32F_STENCIL8;
+  GLenum attachment = stencil ? GL_DEPTH_STENCIL_ATTACHMENT : GL_DEPTH_ATTACHMENT;
+  glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, 0);
+  if (depth) {
+    glFramebufferRenderbuffer(GL_DRAW_FRAMEBUFFER, attachment, GL_RENDERBUFFER, mDepth);
+  }
+
+  // Errors which occurred before are not related to the blit, so they are discarded here.
+  while (glGetError() != GL_NO_ERROR) {
+  }
+
+  // Depth values must not be interpolated, and OpenGL only supports nearest filtering for them.
+  glBlitFramebuffer(x, y, x + width, y + height, 0, 0, targetWidth, targetHeight,
+      depth ? GL_DEPTH_BUFFER_BIT : GL_COLOR_BUFFER_BIT, depth ? GL_NEAREST : GL_LINEAR);
+
+  GLenum error = glGetError();
+
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, static_cast<GLuint>(previousDraw));
+
+  if (error != GL_NO_ERROR) {
+    logger().error("Failed to downsample the capture: glBlitFramebuffer() failed with error {}!",
+        static_cast<uint32_t>(error));
+    return false;
+  }
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, mFramebuffer);
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Downsampler::end() {
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, static_cast<GLuint>(mPreviousRead));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+GLenum Downsampler::getDepthFormat() {
+  GLint read = 0;
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &read);
+
+  // The default framebuffer uses different names for its attachments.
+  GLenum depthAttachment   = read == 0 ? GL_DEPTH : GL_DEPTH_ATTACHMENT;
+  GLenum stencilAttachment = read == 0 ? GL_STENCIL : GL_STENCIL_ATTACHMENT;
+
+  GLint depthBits   = 0;
+  GLint stencilBits = 0;
+  GLint type        = 0;
+  glGetFramebufferAttachmentParameteriv(
+      GL_READ_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_DEPTH_SIZE, &depthBits);
+  glGetFramebufferAttachmentParameteriv(
+      GL_READ_FRAMEBUFFER, depthAttachment, GL_FRAMEBUFFER_ATTACHMENT_COMPONENT_TYPE, &type);
+  glGetFramebufferAttachmentParameteriv(
+      GL_READ_FRAMEBUFFER, stencilAttachment, GL_FRAMEBUFFER_ATTACHMENT_STENCIL_SIZE, &stencilBits);
+
+  if (type == GL_FLOAT) {
+    return stencilBits > 0 ? GL_DEPTH32F_STENCIL8 : GL_DEPTH_COMPONENT32F;
+  }
+
+  if (depthBits <= 16) {
+    return GL_DEPTH_COMPONENT16;
+  }
+
+  if (depthBits <= 24) {
+    return stencilBits > 0 ? GL_DEPTH24_STENCIL8 : GL_DEPTH_COMPONENT24;
+  }
+
+  return GL_DEPTH_COMPONENT32;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
@@ -0,0 +1,60 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_DOWNSAMPLER_HPP
+#define CSP_WEB_API_DOWNSAMPLER_HPP
+
+#include <GL/glew.h>
+
+#include <cstdint>
+
+namespace csp::webapi {
+
+/// This class scales a region of the currently bound read framebuffer on the GPU, so that less
+/// data has to be read back and encoded. The region is blitted into an internal framebuffer of
+/// the target size, which is then bound as read framebuffer. This way, it can be read with a
+/// PixelReadback like the original framebuffer.
+/// All methods of this class have to be called from the thread which owns the OpenGL context.
+class Downsampler {
+ public:
+  Downsampler();
+  ~Downsampler();
+
+  Downsampler(Downsampler const& other) = delete;
+  Downsampler(Downsampler&& other)      = delete;
+
+  Downsampler& operator=(Downsampler const& other) = delete;
+  Downsampler& operator=(Downsampler&& other) = delete;
+
+  /// Blits the given region of the current read framebuffer to the internal framebuffer and binds
+  /// it as read framebuffer. Colors are filtered linearly, depth values are taken from the nearest
+  /// pixel. Returns false if the blit failed, for example because the read framebuffer is
+  /// multisampled. In this case, the bindings are not changed.
+  bool begin(bool depth, int32_t x, int32_t y, int32_t width, int32_t height, int32_t targetWidth,
+      int32_t targetHeight);
+
+  /// Binds the read framebuffer which was bound before begin() again.
+  void end();
+
+ private:
+  /// Returns the internal format of the depth buffer of the current read framebuffer. The formats
+  /// have to match for blitting depth values.
+  static GLenum getDepthFormat();
+
+  GLuint  mFramebuffer  = 0;
+  GLuint  mColor        = 0;
+  GLuint  mDepth        = 0;
+  int32_t mWidth        = 0;
+  int32_t mHeight       = 0;
+  int32_t mDepthWidth   = 0;
+  int32_t mDepthHeight  = 0;
+  GLenum  mDepthFormat  = 0;
+  GLint   mPreviousRead = 0;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_DOWNSAMPLER_HPP
@@ -0,0 +1,289 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "EventChannel.hpp"
+
+#include "LogBuffer.hpp"
+#include "logger.hpp"
+
+#include <array>
+#include <utility>
+#include <vector>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+using Topic = csp::webapi::EventChannel::Topic;
+
+const std::array<std::pair<Topic, char const*>, 3> TOPIC_NAMES{
+    {{Topic::eLog, "log"}, {Topic::eSettings, "settings"}, {Topic::eCapture, "capture"}}};
+
+// New log messages are sent at most this often.
+const std::chrono::milliseconds LOG_INTERVAL(100);
+
+// If more events are waiting for the sender thread, the oldest ones are dropped.
+const size_t MAX_QUEUED_EVENTS = 1000;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+char const* getTopicName(Topic topic) {
+  for (auto const& t : TOPIC_NAMES) {
+    if (t.first == topic) {
+      return t.second;
+    }
+  }
+  return "";
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Converts a json array of topic names to a bit mask of Topic values. Unknown names are ignored.
+uint32_t getTopicMask(nlohmann::json const& names) {
+  uint32_t mask = 0;
+
+  if (!names.is_array()) {
+    return mask;
+  }
+
+  for (auto const& name : names) {
+    for (auto const& t : TOPIC_NAMES) {
+      if (name.is_string() && name.get<std::string>() == t.second) {
+        mask |= static_cast<uint32_t>(t.first);
+      }
+    }
+  }
+
+  return mask;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+EventChannel::EventChannel(LogBuffer const& logBuffer)
+    : mLogBuffer(logBuffer)
+    , mLogCursor(logBuffer.getLastSequence())
+    , mThread([this]() { run(); }) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+EventChannel::~EventChannel() {
+  {
+    std::lock_guard<std::mutex> lock(mEventsMutex);
+    mStop = true;
+  }
+
+  mEventsCondition.notify_one();
+  mThread.join();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool EventChannel::hasSubscribers(Topic topic) const {
+  return (mSubscriptions.load() & static_cast<uint32_t>(topic)) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void EventChannel::publish(Topic topic, nlohmann::json const& data) {
+  if (!hasSubscribers(topic)) {
+    return;
+  }
+
+  nlohmann::json event{{"topic", getTopicName(topic)}, {"data", data}};
+
+  {
+    std::lock_guard<std::mutex> lock(mEventsMutex);
+    if (mEvents.size() >= MAX_QUEUED_EVENTS) {
+      mEvents.pop();
+    }
+    mEvents.push({topic, event.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace)});
+  }
+
+  mEventsCondition.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool EventChannel::handleConnection(CivetServer* /*server*/, mg_connection const* /*conn*/) {
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void EventChannel::handleReadyState(CivetServer* /*server*/, mg_connection* conn) {
+  auto client         = std::make_shared<Client>();
+  client->mConnection = conn;
+
+  std::lock_guard<std::mutex> lock(mClientsMutex);
+  mClients[conn] = client;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool EventChannel::handleData(
+    CivetServer* /*server*/, mg_connection* conn, int bits, char* data, size_t length) {
+
+  // The lower four bits contain the opcode. Returning false closes the connection.
+  int opcode = bits & 0xf;
+
+  if (opcode == MG_WEBSOCKET_OPCODE_CONNECTION_CLOSE) {
+    return false;
+  }
+
+  if (opcode != MG_WEBSOCKET_OPCODE_TEXT) {
+    return true;
+  }
+
+  auto request = nlohmann::json::parse(data, data + length, nullptr, false);
+
+  if (!request.is_object()) {
+    logger().warn("Ignoring invalid message on /events: {}", std::string(data, length));
+    return true;
+  }
+
+  uint32_t subscribe   = getTopicMask(request.value("subscribe", nlohmann::json()));
+  uint32_t unsubscribe = getTopicMask(request.value("unsubscribe", nlohmann::json()));
+
+  {
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    auto                        it = mClients.find(conn);
+    if (it != mClients.end()) {
+      it->second->mTopics = (it->second->mTopics | subscribe) & ~unsubscribe;
+      updateSubscriptions();
+    }
+  }
+
+  // The sender thread may have to start polling the log messages. Locking the mutex ensures that
+  // the sender thread is either waiting already or will see the new subscriptions.
+  {
+    std::lock_guard<std::mutex> lock(mEventsMutex);
+  }
+
+  mEventsCondition.notify_one();
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void EventChannel::handleClose(CivetServer* /*server*/, mg_connection const* conn) {
+  std::shared_ptr<Client> client;
+
+  {
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
+    auto it = mClients.find(const_cast<mg_connection*>(conn));
+    if (it == mClients.end()) {
+      return;
+    }
+    client = it->second;
+    mClients.erase(it);
+    updateSubscriptions();
+  }
+
+  // civetweb frees the connection once this method returns. So we wait until the sender thread
+  // finished writing to it and make sure that it will not be used again.
+  std::lock_guard<std::mutex> lock(client->mWriteMutex);
+  client->mClosed = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void EventChannel::run() {
+  while (true) {
+    std::queue<Event> events;
+
+    {
+      std::unique_lock<std::mutex> lock(mEventsMutex);
+
+      // As long as someone is interested in log messages, we wake up regularly in order to check
+      // for new ones. Else we sleep until there is something to send.
+      if (hasSubscribers(Topic::eLog)) {
+        mEventsCondition.wait_for(
+            lock, LOG_INTERVAL, [this]() { return mStop || !mEvents.empty(); });
+      } else {
+        mEventsCondition.wait(lock, [this]() {
+          return mStop || !mEvents.empty() || hasSubscribers(Topic::eLog);
+        });
+      }
+
+      if (mStop) {
+        return;
+      }
+
+      std::swap(events, mEvents);
+    }
+
+    // If nobody is interested in log messages, we just skip them. This way, new subscribers will
+    // only receive messages logged after their subscription.
+    if (hasSubscribers(Topic::eLog)) {
+      auto messages = mLogBuffer.getSince(mLogCursor, 1000);
+      if (!messages.empty()) {
+        // Log messages may contain arbitrary bytes, invalid UTF-8 sequences are replaced.
+        // Otherwise, dump() would throw on this thread and terminate the application.
+        nlohmann::json event{{"topic", getTopicName(Topic::eLog)}, {"data", messages}};
+        send(Topic::eLog, event.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace));
+      }
+    } else {
+      mLogCursor = mLogBuffer.getLastSequence();
+    }
+
+    while (!events.empty()) {
+      send(events.front().mTopic, events.front().mMessage);
+      events.pop();
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void EventChannel::send(Topic topic, std::string const& message) {
+
+  // The recipients are collected first, so that a slow client does not block subscriptions and
+  // closing connections while the message is written.
+  std::vector<std::shared_ptr<Client>> recipients;
+
+  {
+    std::lock_guard<std::mutex> lock(mClientsMutex);
+    for (auto const& client : mClients) {
+      if ((client.second->mTopics & static_cast<uint32_t>(topic)) != 0) {
+        recipients.push_back(client.second);
+      }
+    }
+  }
+
+  // civetweb serializes concurrent writes to the same connection internally.
+  for (auto const& client : recipients) {
+    std::lock_guard<std::mutex> lock(client->mWriteMutex);
+    if (!client->mClosed) {
+      mg_websocket_write(
+          client->mConnection, MG_WEBSOCKET_OPCODE_TEXT, message.data(), message.size());
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void EventChannel::updateSubscriptions() {
+  uint32_t subscriptions = 0;
+
+  for (auto const& client : mClients) {
+    subscriptions |= client.second->mTopics;
+  }
+
+  mSubscriptions = subscriptions;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
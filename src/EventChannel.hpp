@@ -0,0 +1,101 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_EVENT_CHANNEL_HPP
+#define CSP_WEB_API_EVENT_CHANNEL_HPP
+
+#include <CivetServer.h>
+#include <nlohmann/json.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace csp::webapi {
+
+class LogBuffer;
+
+/// This WebSocket handler pushes events to connected clients. Clients choose the topics they are
+/// interested in by sending text messages like {"subscribe": ["log", "settings"]} or
+/// {"unsubscribe": ["log"]}. Each event is sent as a text message of the form
+/// {"topic": "capture", "data": {...}}.
+/// New log messages are collected from the given LogBuffer by a sender thread, so that the log
+/// hook does not have to do any additional work. All other events are published explicitly. The
+/// actual sending is done by the sender thread as well, so publish() never blocks on the network.
+/// If the sender thread falls behind, the oldest queued events are dropped. All methods are
+/// thread-safe.
+class EventChannel : public CivetWebSocketHandler {
+ public:
+  enum class Topic : uint32_t { eLog = 1, eSettings = 2, eCapture = 4 };
+
+  explicit EventChannel(LogBuffer const& logBuffer);
+  ~EventChannel() override;
+
+  EventChannel(EventChannel const& other) = delete;
+  EventChannel(EventChannel&& other)      = delete;
+
+  EventChannel& operator=(EventChannel const& other) = delete;
+  EventChannel& operator=(EventChannel&& other) = delete;
+
+  /// Returns true if at least one client subscribed to the given topic. This can be used to skip
+  /// the assembly of expensive events.
+  bool hasSubscribers(Topic topic) const;
+
+  /// Queues the given event for all clients which subscribed to the given topic. If there are no
+  /// such clients, the event is discarded right away.
+  void publish(Topic topic, nlohmann::json const& data);
+
+  bool handleConnection(CivetServer* server, mg_connection const* conn) override;
+  void handleReadyState(CivetServer* server, mg_connection* conn) override;
+  bool handleData(
+      CivetServer* server, mg_connection* conn, int bits, char* data, size_t length) override;
+  void handleClose(CivetServer* server, mg_connection const* conn) override;
+
+ private:
+  struct Event {
+    Topic       mTopic;
+    std::string mMessage;
+  };
+
+  // A connected client. mWriteMutex is held while a message is written to the connection. Once
+  // mClosed is set, the connection must not be used anymore.
+  struct Client {
+    mg_connection* mConnection = nullptr;
+    uint32_t       mTopics     = 0;
+    std::mutex     mWriteMutex;
+    bool           mClosed = false;
+  };
+
+  void run();
+  void send(Topic topic, std::string const& message);
+  void updateSubscriptions();
+
+  LogBuffer const& mLogBuffer;
+  uint64_t         mLogCursor = 0;
+
+  // The subscribed topics of each client are stored as a bit mask of Topic values. mSubscriptions
+  // is the combination of all masks.
+  std::mutex                                                  mClientsMutex;
+  std::unordered_map<mg_connection*, std::shared_ptr<Client>> mClients;
+  std::atomic<uint32_t>                                       mSubscriptions{0};
+
+  std::mutex              mEventsMutex;
+  std::condition_variable mEventsCondition;
+  std::queue<Event>       mEvents;
+  bool                    mStop = false;
+
+  std::thread mThread;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_EVENT_CHANNEL_HPP
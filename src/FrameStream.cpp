@@ -0,0 +1,125 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "FrameStream.hpp"
+
+#include <algorithm>
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int32_t FrameStream::addViewer(double fps) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mViewers[mNextViewerID] = fps;
+  return mNextViewerID++;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void FrameStream::removeViewer(int32_t id) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mViewers.erase(id);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool FrameStream::beginFrame() {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (mViewers.empty() || mFrameInProduction || mClosed) {
+    return false;
+  }
+
+  // The frame interval is determined by the fastest viewer.
+  double maxFps = 0.0;
+  for (auto const& viewer : mViewers) {
+    maxFps = std::max(maxFps, viewer.second);
+  }
+
+  auto now      = Clock::now();
+  auto interval = std::chrono::duration<double>(1.0 / maxFps);
+
+  if (now - mLastFrameTime < interval) {
+    return false;
+  }
+
+  mLastFrameTime     = now;
+  mFrameInProduction = true;
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void FrameStream::publish(std::vector<std::byte>&& data) {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mFrameInProduction = false;
+
+    if (data.empty()) {
+      return;
+    }
+
+    mFrame.mData = std::make_shared<std::vector<std::byte> const>(std::move(data));
+    ++mFrame.mNumber;
+  }
+
+  mCondition.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::optional<FrameStream::Frame> FrameStream::waitForFrame(
+    uint64_t after, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mMutex);
+
+  bool available = mCondition.wait_for(
+      lock, timeout, [this, after]() { return mClosed || mFrame.mNumber > after; });
+
+  if (!available || mClosed) {
+    return std::nullopt;
+  }
+
+  return mFrame;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool FrameStream::sleepUntil(Clock::time_point time) {
+  std::unique_lock<std::mutex> lock(mMutex);
+  return !mCondition.wait_until(lock, time, [this]() { return mClosed; });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void FrameStream::close() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mClosed = true;
+  }
+
+  mCondition.notify_all();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void FrameStream::open() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mClosed = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool FrameStream::isClosed() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mClosed;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
@@ -0,0 +1,77 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_FRAME_STREAM_HPP
+#define CSP_WEB_API_FRAME_STREAM_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+namespace csp::webapi {
+
+/// This class distributes a continuous stream of encoded frames to any number of viewers. Only the
+/// most recent frame is stored, so viewers which cannot keep up will simply skip frames. The main
+/// thread uses beginFrame() to decide whether a new frame has to be captured. This way, all viewers
+/// share the same readback and encoding of each frame.
+/// All methods are thread-safe.
+class FrameStream {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct Frame {
+    uint64_t                                      mNumber = 0;
+    std::shared_ptr<std::vector<std::byte> const> mData;
+  };
+
+  /// Viewers have to register with their desired frame rate. The returned ID has to be passed to
+  /// removeViewer() once the viewer disconnects.
+  int32_t addViewer(double fps);
+  void    removeViewer(int32_t id);
+
+  /// Returns true if there is at least one viewer, no frame is currently being produced and the
+  /// last frame is older than the frame interval of the fastest viewer. If true is returned, the
+  /// stream considers a frame to be in production until publish() is called.
+  bool beginFrame();
+
+  /// Makes the given frame available to all viewers. An empty frame is not published, but it ends
+  /// the production of the current frame nevertheless.
+  void publish(std::vector<std::byte>&& data);
+
+  /// Blocks until a frame with a number larger than the given one is available, the timeout
+  /// expired, or the stream has been closed. Only in the first case a frame is returned.
+  std::optional<Frame> waitForFrame(uint64_t after, std::chrono::milliseconds timeout);
+
+  /// Blocks until the given point in time or until the stream has been closed. Returns false in
+  /// the latter case.
+  bool sleepUntil(Clock::time_point time);
+
+  /// Closing the stream wakes up all waiting viewers. This has to be done before the server is
+  /// stopped, as it waits for all requests to finish. Opening the stream again allows new viewers
+  /// to wait for frames.
+  void close();
+  void open();
+  bool isClosed() const;
+
+ private:
+  mutable std::mutex        mMutex;
+  std::condition_variable   mCondition;
+  std::map<int32_t, double> mViewers;
+  int32_t                   mNextViewerID = 0;
+  Frame                     mFrame;
+  bool                      mFrameInProduction = false;
+  Clock::time_point         mLastFrameTime;
+  bool                      mClosed = false;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_FRAME_STREAM_HPP
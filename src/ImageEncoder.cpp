@@ -0,0 +1,1245 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "ImageEncoder.hpp"
+
+#include "ThreadPool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <tiffio.h>
+
+// On x86, the conversion of depth values to half-precision floats uses the F16C instructions if
+// the CPU supports them. They are enabled per function, so the plugin still runs on CPUs without.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define CSP_WEB_API_F16C __attribute__((target("avx,f16c")))
+#include <immintrin.h>
+#elif defined(_M_X64) && defined(_MSC_VER)
+#define CSP_WEB_API_F16C
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <stb_image_write.h>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Images are split into strips of at least this many rows for parallel encoding.
+const int32_t MIN_STRIP_HEIGHT = 64;
+
+// Deflate blocks without compression can store at most this many bytes.
+const size_t MAX_STORED_BLOCK_SIZE = 65535;
+
+// stbi_zlib_compress() silently raises all compression levels below this one to it. We do the same
+// explicitly, so that the effective level is visible here.
+const int32_t MIN_STBI_ZLIB_LEVEL = 5;
+
+// The Adler-32 checksum is computed modulo this prime.
+const uint32_t ADLER_MODULUS = 65521;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns the number of strips an image with the given height is split into.
+uint32_t getStripCount(int32_t height, uint32_t threadCount) {
+  auto maxCount = static_cast<int32_t>(std::max(threadCount, 1U));
+  return static_cast<uint32_t>(std::clamp(height / MIN_STRIP_HEIGHT, 1, maxCount));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// All strips of all images are encoded on this pool, so that concurrent encodes share the cores
+// instead of each spawning its own threads. The calling threads work on a strip as well, hence
+// the pool has one thread less than there are cores.
+csp::webapi::ThreadPool& getStripPool() {
+  static csp::webapi::ThreadPool pool(std::max(std::thread::hardware_concurrency(), 2U) - 1);
+  return pool;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Splits the rows of an image into the given number of strips and calls the given function for
+// each strip in parallel. The function receives the index of the strip as well as its first and
+// one-past-last row. The first strip is processed by the calling thread, the others by the strip
+// pool. An exception thrown for any strip is rethrown once all strips are done.
+void forEachStrip(int32_t height, uint32_t stripCount,
+    std::function<void(uint32_t, int32_t, int32_t)> const& function) {
+
+  auto getRow = [height, stripCount](uint32_t strip) {
+    return static_cast<int32_t>(static_cast<int64_t>(height) * strip / stripCount);
+  };
+
+  std::mutex              mutex;
+  std::condition_variable stripsDone;
+  uint32_t                remaining = stripCount - 1;
+  std::exception_ptr      error;
+
+  for (uint32_t i(1); i < stripCount; ++i) {
+    getStripPool().enqueue([&, i]() {
+      std::exception_ptr stripError;
+      try {
+        function(i, getRow(i), getRow(i + 1));
+      } catch (...) { stripError = std::current_exception(); }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stripError) {
+        error = stripError;
+      }
+      if (--remaining == 0) {
+        stripsDone.notify_one();
+      }
+    });
+  }
+
+  try {
+    function(0, 0, getRow(1));
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::current_exception();
+  }
+
+  // The other strips reference the local variables, so we have to wait for them in any case.
+  std::unique_lock<std::mutex> lock(mutex);
+  stripsDone.wait(lock, [&remaining]() { return remaining == 0; });
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void writeBigEndian(std::byte*& out, uint32_t value) {
+  for (int32_t shift(24); shift >= 0; shift -= 8) {
+    *out++ = static_cast<std::byte>((value >> static_cast<uint32_t>(shift)) & 0xffU);
+  }
+}
+
+void writeLittleEndian(std::byte*& out, uint32_t value) {
+  for (uint32_t shift(0); shift < 32; shift += 8) {
+    *out++ = static_cast<std::byte>((value >> shift) & 0xffU);
+  }
+}
+
+void writeBytes(std::byte*& out, void const* data, size_t length) {
+  std::memcpy(out, data, length);
+  out += length;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The CRC-32 which is used for PNG chunks.
+uint32_t computeCRC(std::byte const* data, size_t length) {
+  static const auto table = []() {
+    std::array<uint32_t, 256> result{};
+    for (uint32_t i(0); i < result.size(); ++i) {
+      uint32_t c = i;
+      for (int32_t k(0); k < 8; ++k) {
+        c = (c & 1U) ? 0xedb88320U ^ (c >> 1U) : c >> 1U;
+      }
+      result[i] = c;
+    }
+    return result;
+  }();
+
+  uint32_t crc = 0xffffffffU;
+  for (size_t i(0); i < length; ++i) {
+    crc = table[(crc ^ static_cast<uint32_t>(data[i])) & 0xffU] ^ (crc >> 8U);
+  }
+  return crc ^ 0xffffffffU;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The Adler-32 checksum which terminates zlib streams.
+uint32_t computeAdler(std::byte const* data, size_t length) {
+
+  // This is the largest number of bytes which can be summed up before b could overflow.
+  const size_t blockSize = 5552;
+
+  uint32_t a = 1;
+  uint32_t b = 0;
+
+  for (size_t start(0); start < length; start += blockSize) {
+    size_t end = std::min(start + blockSize, length);
+    for (size_t i(start); i < end; ++i) {
+      a += static_cast<uint32_t>(data[i]);
+      b += a;
+    }
+    a %= ADLER_MODULUS;
+    b %= ADLER_MODULUS;
+  }
+
+  return (b << 16U) | a;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes a PNG chunk with the given four-letter type. The CRC covers the type and the data.
+void writeChunk(std::byte*& out, char const* type, std::byte const* data, size_t length) {
+  writeBigEndian(out, static_cast<uint32_t>(length));
+
+  auto* start = out;
+  writeBytes(out, type, 4);
+  if (length > 0) {
+    writeBytes(out, data, length);
+  }
+  writeBigEndian(out, computeCRC(start, length + 4));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint8_t paethPredictor(int32_t a, int32_t b, int32_t c) {
+  int32_t p  = a + b - c;
+  int32_t pa = std::abs(p - a);
+  int32_t pb = std::abs(p - b);
+  int32_t pc = std::abs(p - c);
+
+  if (pa <= pb && pa <= pc) {
+    return static_cast<uint8_t>(a);
+  }
+  return static_cast<uint8_t>(pb <= pc ? b : c);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Applies the PNG filter of the given type to a row of RGB pixels. The prior row is the unfiltered
+// row above. Returns the sum of the absolute values of the filtered bytes, interpreted as signed
+// values. This is the heuristic recommended by the PNG specification for choosing a filter.
+uint32_t filterRow(
+    uint8_t const* row, uint8_t const* prior, size_t stride, uint8_t type, uint8_t* out) {
+  const size_t bpp = 3;
+  uint32_t     sum = 0;
+
+  for (size_t i(0); i < stride; ++i) {
+    int32_t a = i < bpp ? 0 : row[i - bpp];
+    int32_t b = prior[i];
+    int32_t c = i < bpp ? 0 : prior[i - bpp];
+
+    uint8_t predictor = 0;
+    switch (type) {
+    case 1:
+      predictor = static_cast<uint8_t>(a);
+      break;
+    case 2:
+      predictor = static_cast<uint8_t>(b);
+      break;
+    case 3:
+      predictor = static_cast<uint8_t>((a + b) / 2);
+      break;
+    case 4:
+      predictor = paethPredictor(a, b, c);
+      break;
+    default:
+      break;
+    }
+
+    out[i] = static_cast<uint8_t>(row[i] - predictor);
+    sum += static_cast<uint32_t>(std::abs(static_cast<int8_t>(out[i])));
+  }
+
+  return sum;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Filters the given output rows of the image. Each output row is prefixed with the type of the
+// filter which produced the smallest sum of absolute values.
+void filterRows(std::byte const* pixels, int32_t width, int32_t height, int32_t begin,
+    int32_t end, std::vector<std::byte>& filtered) {
+  size_t               stride = static_cast<size_t>(width) * 3;
+  std::vector<uint8_t> zeros(stride, 0);
+  std::vector<uint8_t> candidate(stride);
+
+  auto getRow = [&](int32_t y) {
+    return reinterpret_cast<uint8_t const*>(pixels) + (height - 1 - y) * stride;
+  };
+
+  for (int32_t y(begin); y < end; ++y) {
+    auto* row   = getRow(y);
+    auto* prior = y == 0 ? zeros.data() : getRow(y - 1);
+    auto* out   = reinterpret_cast<uint8_t*>(filtered.data()) + y * (stride + 1);
+
+    out[0]       = 0;
+    uint32_t min = filterRow(row, prior, stride, 0, out + 1);
+
+    for (uint8_t type(1); type <= 4; ++type) {
+      uint32_t sum = filterRow(row, prior, stride, type, candidate.data());
+      if (sum < min) {
+        min    = sum;
+        out[0] = type;
+        std::copy(candidate.begin(), candidate.end(), out + 1);
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns the size of a zlib stream which stores the given number of bytes without compression.
+size_t getStoredStreamSize(size_t length) {
+  size_t blocks = std::max<size_t>(1, (length + MAX_STORED_BLOCK_SIZE - 1) / MAX_STORED_BLOCK_SIZE);
+  return 2 + blocks * 5 + length + 4;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes a zlib stream which stores the given data in uncompressed deflate blocks.
+void writeStoredStream(std::byte*& out, std::byte const* data, size_t length) {
+  *out++ = std::byte{0x78};
+  *out++ = std::byte{0x01};
+
+  size_t offset = 0;
+  do {
+    auto size = static_cast<uint32_t>(std::min(length - offset, MAX_STORED_BLOCK_SIZE));
+    bool last = offset + size == length;
+
+    *out++ = std::byte{last ? uint8_t{1} : uint8_t{0}};
+    *out++ = static_cast<std::byte>(size & 0xffU);
+    *out++ = static_cast<std::byte>(size >> 8U);
+    *out++ = static_cast<std::byte>(~size & 0xffU);
+    *out++ = static_cast<std::byte>((~size >> 8U) & 0xffU);
+    writeBytes(out, data + offset, size);
+
+    offset += size;
+  } while (offset < length);
+
+  writeBigEndian(out, computeAdler(data, length));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Combines the Adler-32 checksums of two consecutive pieces of data to the checksum of both. Only
+// the length of the second piece is required.
+uint32_t combineAdler(uint32_t first, uint32_t second, size_t secondLength) {
+  uint64_t length = secondLength % ADLER_MODULUS;
+  uint64_t a      = (first & 0xffffU) + (second & 0xffffU) + ADLER_MODULUS - 1;
+  uint64_t b      = length * (first & 0xffffU) + (first >> 16U) + (second >> 16U) + ADLER_MODULUS -
+               length;
+  return static_cast<uint32_t>(((b % ADLER_MODULUS) << 16U) | (a % ADLER_MODULUS));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reads the bits of a deflate stream, starting with the least significant bit of each byte.
+class BitReader {
+ public:
+  BitReader(uint8_t const* data, size_t size)
+      : mData(data)
+      , mBitCount(size * 8) {
+  }
+
+  // Returns the next count bits without consuming them. At most 17 bits can be peeked at once.
+  // Bits beyond the end of the data are zero.
+  uint32_t peek(uint32_t count) const {
+    uint32_t value = 0;
+    size_t   first = mPosition / 8;
+    for (size_t i(0); i < 3 && (first + i) * 8 < mBitCount; ++i) {
+      value |= static_cast<uint32_t>(mData[first + i]) << (8U * i);
+    }
+    return (value >> (mPosition % 8)) & ((1U << count) - 1U);
+  }
+
+  uint32_t read(uint32_t count) {
+    uint32_t value = peek(count);
+    mPosition += count;
+    return value;
+  }
+
+  void skip(size_t count) {
+    mPosition += count;
+  }
+
+  void alignToByte() {
+    mPosition = (mPosition + 7) / 8 * 8;
+  }
+
+  size_t getPosition() const {
+    return mPosition;
+  }
+
+  bool isPastEnd() const {
+    return mPosition > mBitCount;
+  }
+
+ private:
+  uint8_t const* mData;
+  size_t         mBitCount;
+  size_t         mPosition = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The position of the last block in a deflate stream, both in bits from the start of the stream.
+struct DeflateEnd {
+  size_t mFinalBlock = 0; ///< The position of the final-block flag of the last block.
+  size_t mEnd        = 0; ///< The position right after the end of the last block.
+};
+
+// Finds the last block of the given deflate stream by skipping over all blocks before it. Only
+// stored blocks and blocks with fixed Huffman codes are supported, as stbi_zlib_compress() does not
+// write any others. Returns std::nullopt if the stream is invalid or contains other blocks.
+std::optional<DeflateEnd> findDeflateEnd(uint8_t const* data, size_t size) {
+
+  // The fixed Huffman codes of the literal and length symbols are up to nine bits long. This table
+  // contains the symbol and the code length for each possible value of the next nine bits.
+  static const auto codes = []() {
+    std::array<std::pair<uint16_t, uint8_t>, 512> result{};
+    auto addCodes = [&](uint32_t firstSymbol, uint32_t lastSymbol, uint32_t firstCode,
+                        uint32_t length) {
+      for (uint32_t symbol(firstSymbol); symbol <= lastSymbol; ++symbol) {
+        // Huffman codes are stored starting with their most significant bit.
+        uint32_t code     = firstCode + symbol - firstSymbol;
+        uint32_t reversed = 0;
+        for (uint32_t i(0); i < length; ++i) {
+          reversed |= ((code >> i) & 1U) << (length - 1 - i);
+        }
+        for (uint32_t rest(0); rest < (1U << (9 - length)); ++rest) {
+          result.at(reversed | (rest << length)) = {symbol, length};
+        }
+      }
+    };
+    addCodes(0, 143, 0x30, 8);
+    addCodes(144, 255, 0x190, 9);
+    addCodes(256, 279, 0x00, 7);
+    addCodes(280, 287, 0xc0, 8);
+    return result;
+  }();
+
+  BitReader reader(data, size);
+
+  while (!reader.isPastEnd()) {
+    size_t   header = reader.getPosition();
+    bool     final  = reader.read(1) == 1;
+    uint32_t type   = reader.read(2);
+
+    if (type == 0) {
+      reader.alignToByte();
+      uint32_t length = reader.read(16);
+      reader.skip(16 + static_cast<size_t>(length) * 8);
+    } else if (type == 1) {
+      while (!reader.isPastEnd()) {
+        auto [symbol, codeLength] = codes.at(reader.peek(9));
+        reader.skip(codeLength);
+
+        if (symbol == 256) {
+          break;
+        }
+
+        if (symbol < 256) {
+          continue;
+        }
+
+        // Lengths and distances are followed by extra bits. Distance codes are five bits long.
+        uint32_t lengthCode = symbol - 257U;
+        if (lengthCode >= 29) {
+          return std::nullopt;
+        }
+        reader.skip(lengthCode < 8 || lengthCode == 28 ? 0 : (lengthCode - 4) / 4);
+
+        uint32_t distanceCode = 0;
+        for (uint32_t i(0); i < 5; ++i) {
+          distanceCode = (distanceCode << 1U) | reader.read(1);
+        }
+        if (distanceCode >= 30) {
+          return std::nullopt;
+        }
+        reader.skip(distanceCode < 4 ? 0 : (distanceCode - 2) / 2);
+      }
+    } else {
+      return std::nullopt;
+    }
+
+    if (final) {
+      if (reader.isPastEnd()) {
+        return std::nullopt;
+      }
+      return DeflateEnd{header, reader.getPosition()};
+    }
+  }
+
+  return std::nullopt;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A strip of a PNG which has been filtered and compressed independently of the other strips.
+struct PNGStrip {
+  std::unique_ptr<unsigned char, decltype(&std::free)> mCompressed{nullptr, &std::free};
+
+  // The part of the compressed data which is written to the IDAT chunk of this strip, followed
+  // by this many bytes of the empty stored block which ends the strip.
+  unsigned char const* mData      = nullptr;
+  size_t               mSize      = 0;
+  size_t               mFlushSize = 0;
+
+  // The Adler-32 checksum and the length of the uncompressed data.
+  uint32_t mAdler  = 1;
+  size_t   mLength = 0;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Compresses the given data with stbi_zlib_compress() and prepares it for being joined with the
+// strips after it. For this, the final-block flag of the last deflate block is cleared and, like a
+// sync flush of zlib, an empty stored block is appended so that the next strip starts at a byte
+// boundary. The stored block starts with three zero bits, which fit into the padding after the last
+// block if it is long enough. Otherwise, another zero byte is required. Returns false if the
+// compression failed.
+bool compressPNGStrip(
+    std::byte const* data, size_t length, int32_t level, bool last, PNGStrip& strip) {
+  int compressedSize = 0;
+  strip.mCompressed.reset(stbi_zlib_compress(
+      reinterpret_cast<unsigned char*>(const_cast<std::byte*>(data)), static_cast<int>(length),
+      &compressedSize, std::max(level, MIN_STBI_ZLIB_LEVEL)));
+
+  // The zlib stream consists of a two byte header, the deflate data and the Adler-32 checksum.
+  if (!strip.mCompressed || compressedSize < 6) {
+    return false;
+  }
+
+  auto* compressed = strip.mCompressed.get();
+  strip.mData      = compressed + 2;
+  strip.mSize      = static_cast<size_t>(compressedSize) - 6;
+  strip.mLength    = length;
+  strip.mAdler     = 0;
+  for (int32_t i(0); i < 4; ++i) {
+    strip.mAdler = (strip.mAdler << 8U) | compressed[strip.mSize + 2 + i];
+  }
+
+  if (last) {
+    return true;
+  }
+
+  auto end = findDeflateEnd(strip.mData, strip.mSize);
+  if (!end || (end->mEnd + 7) / 8 != strip.mSize) {
+    return false;
+  }
+
+  compressed[2 + end->mFinalBlock / 8] &= ~(1U << (end->mFinalBlock % 8));
+
+  // The padding bits are cleared, so that they can serve as the header of the stored block. Then
+  // only its length and the complement of its length are missing.
+  if (end->mEnd % 8 != 0) {
+    compressed[1 + strip.mSize] &= (1U << (end->mEnd % 8)) - 1U;
+  }
+
+  size_t padding   = strip.mSize * 8 - end->mEnd;
+  strip.mFlushSize = padding >= 3 ? 4 : 5;
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Writes the bytes of the empty stored block which is appended to a compressed strip.
+void writeFlush(std::byte*& out, size_t size) {
+  if (size == 5) {
+    *out++ = std::byte{0};
+  }
+
+  const std::array<uint8_t, 4> block{0, 0, 0xff, 0xff};
+  writeBytes(out, block.data(), block.size());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct QOIPixel {
+  uint8_t r = 0;
+  uint8_t g = 0;
+  uint8_t b = 0;
+  uint8_t a = 255;
+
+  bool operator==(QOIPixel const& other) const {
+    return r == other.r && g == other.g && b == other.b && a == other.a;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Encodes the given output rows of the image as a sequence of QOI chunks. A decoder processes the
+// chunks of all strips as a single sequence, so this has to be careful not to rely on decoder
+// state which it does not know: The previous pixel is the last pixel of the previous strip, and
+// only index entries which have been written in this strip are used.
+std::vector<std::byte> encodeQOIStrip(
+    std::byte const* pixels, int32_t width, int32_t height, int32_t begin, int32_t end) {
+
+  auto getPixel = [&](int32_t x, int32_t y) {
+    auto*    rgb = reinterpret_cast<uint8_t const*>(pixels) +
+                ((static_cast<size_t>(height - 1 - y) * width) + x) * 3;
+    QOIPixel pixel;
+    pixel.r = rgb[0];
+    pixel.g = rgb[1];
+    pixel.b = rgb[2];
+    return pixel;
+  };
+
+  auto getHash = [](QOIPixel const& p) { return (p.r * 3 + p.g * 5 + p.b * 7 + p.a * 11) % 64; };
+
+  std::array<QOIPixel, 64> index{};
+  std::array<bool, 64>     valid{};
+  QOIPixel                 previous;
+
+  // The decoder stores each pixel in its index, so the last pixel of the previous strip is there.
+  if (begin > 0) {
+    previous                  = getPixel(width - 1, begin - 1);
+    index[getHash(previous)] = previous;
+    valid[getHash(previous)] = true;
+  }
+
+  std::vector<std::byte> result;
+  result.reserve(static_cast<size_t>(end - begin) * width * 4);
+
+  auto write = [&result](uint32_t value) { result.push_back(static_cast<std::byte>(value)); };
+
+  uint32_t run = 0;
+
+  for (int32_t y(begin); y < end; ++y) {
+    for (int32_t x(0); x < width; ++x) {
+      auto pixel = getPixel(x, y);
+
+      if (pixel == previous) {
+        ++run;
+        if (run == 62) {
+          write(0xc0U | (run - 1));
+          run = 0;
+        }
+        continue;
+      }
+
+      if (run > 0) {
+        write(0xc0U | (run - 1));
+        run = 0;
+      }
+
+      auto hash = getHash(pixel);
+
+      if (valid[hash] && index[hash] == pixel) {
+        write(static_cast<uint32_t>(hash));
+      } else {
+        index[hash] = pixel;
+        valid[hash] = true;
+
+        int32_t dr   = pixel.r - previous.r;
+        int32_t dg   = pixel.g - previous.g;
+        int32_t db   = pixel.b - previous.b;
+        int32_t drDg = dr - dg;
+        int32_t dbDg = db - dg;
+
+        // The differences wrap around, so they are computed on signed bytes.
+        dr   = static_cast<int8_t>(dr);
+        dg   = static_cast<int8_t>(dg);
+        db   = static_cast<int8_t>(db);
+        drDg = static_cast<int8_t>(drDg);
+        dbDg = static_cast<int8_t>(dbDg);
+
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          write(0x40U | static_cast<uint32_t>((dr + 2) << 4 | (dg + 2) << 2 | (db + 2)));
+        } else if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 && dbDg >= -8 && dbDg <= 7) {
+          write(0x80U | static_cast<uint32_t>(dg + 32));
+          write(static_cast<uint32_t>((drDg + 8) << 4 | (dbDg + 8)));
+        } else {
+          write(0xfeU);
+          write(pixel.r);
+          write(pixel.g);
+          write(pixel.b);
+        }
+      }
+
+      previous = pixel;
+    }
+  }
+
+  if (run > 0) {
+    write(0xc0U | (run - 1));
+  }
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Depth images are converted and written in strips of this many rows.
+const int32_t DEPTH_ROWS_PER_STRIP = 64;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Converts a float to an IEEE 754 half-precision float, rounding to the nearest even value.
+uint16_t toHalf(float value) {
+  uint32_t bits = 0;
+  std::memcpy(&bits, &value, sizeof(float));
+
+  uint32_t sign     = (bits >> 16U) & 0x8000U;
+  uint32_t exponent = (bits >> 23U) & 0xffU;
+  uint32_t mantissa = bits & 0x7fffffU;
+
+  // Infinity and NaN.
+  if (exponent == 0xffU) {
+    return static_cast<uint16_t>(sign | 0x7c00U | (mantissa ? 0x200U : 0U));
+  }
+
+  int32_t halfExponent = static_cast<int32_t>(exponent) - 127 + 15;
+
+  // Too large values become infinity.
+  if (halfExponent >= 31) {
+    return static_cast<uint16_t>(sign | 0x7c00U);
+  }
+
+  // Too small values become subnormal numbers or zero.
+  if (halfExponent <= 0) {
+    if (halfExponent < -10) {
+      return static_cast<uint16_t>(sign);
+    }
+
+    mantissa |= 0x800000U;
+    auto     shift   = static_cast<uint32_t>(14 - halfExponent);
+    uint32_t half    = mantissa >> shift;
+    uint32_t rest    = mantissa & ((1U << shift) - 1U);
+    uint32_t halfway = 1U << (shift - 1U);
+
+    if (rest > halfway || (rest == halfway && (half & 1U))) {
+      ++half;
+    }
+    return static_cast<uint16_t>(sign | half);
+  }
+
+  // A carry of the rounding may increase the exponent, which is the correct result.
+  uint32_t half = sign | (static_cast<uint32_t>(halfExponent) << 10U) | (mantissa >> 13U);
+  uint32_t rest = mantissa & 0x1fffU;
+
+  if (rest > 0x1000U || (rest == 0x1000U && (half & 1U))) {
+    ++half;
+  }
+  return static_cast<uint16_t>(half);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifdef CSP_WEB_API_F16C
+
+// Returns true if the CPU and the operating system support the AVX and F16C instructions.
+bool hasF16C() {
+#ifdef _MSC_VER
+  static bool const supported = []() {
+    std::array<int, 4> info{};
+    __cpuid(info.data(), 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx     = (info[2] & (1 << 28)) != 0;
+    bool f16c    = (info[2] & (1 << 29)) != 0;
+    return osxsave && avx && f16c && (_xgetbv(0) & 0x6U) == 0x6U;
+  }();
+#else
+  static bool const supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+#endif
+  return supported;
+}
+
+// Converts eight values at a time. The hardware conversion rounds to the nearest even value like
+// toHalf(), which is used for the remaining values.
+CSP_WEB_API_F16C void scaleRowToHalfF16C(
+    float const* in, uint16_t* out, int32_t width, float scale) {
+  __m256  factor = _mm256_set1_ps(scale);
+  int32_t i      = 0;
+
+  for (; i + 8 <= width; i += 8) {
+    __m256  values = _mm256_mul_ps(_mm256_loadu_ps(in + i), factor);
+    __m128i halfs  = _mm256_cvtps_ph(values, _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), halfs);
+  }
+
+  for (; i < width; ++i) {
+    out[i] = toHalf(in[i] * scale);
+  }
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// These convert one row of depth values to the output format. scaleRow() and quantizeRow() are
+// branch-free loops over contiguous memory, which the compiler can vectorize. The scalar toHalf()
+// cannot be vectorized, so scaleRowToHalf() uses the F16C instructions if they are available.
+void scaleRow(float const* in, float* out, int32_t width, float scale) {
+  for (int32_t i(0); i < width; ++i) {
+    out[i] = in[i] * scale;
+  }
+}
+
+void scaleRowToHalf(float const* in, uint16_t* out, int32_t width, float scale) {
+#ifdef CSP_WEB_API_F16C
+  if (hasF16C()) {
+    scaleRowToHalfF16C(in, out, width, scale);
+    return;
+  }
+#endif
+
+  for (int32_t i(0); i < width; ++i) {
+    out[i] = toHalf(in[i] * scale);
+  }
+}
+
+void quantizeRow(float const* in, uint16_t* out, int32_t width, float factor) {
+  for (int32_t i(0); i < width; ++i) {
+    // This maps NaN to zero.
+    float value = in[i] * factor;
+    value       = value >= 0.F ? std::min(value, 65535.F) : 0.F;
+    out[i]      = static_cast<uint16_t>(value + 0.5F);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// libtiff writes to this buffer through the client procedures below. Seeking beyond the end is
+// allowed, the buffer grows as soon as something is written there.
+struct TIFFBuffer {
+  std::vector<std::byte> mData;
+  size_t                 mOffset = 0;
+};
+
+tmsize_t tiffRead(thandle_t handle, void* data, tmsize_t size) {
+  auto* buffer = static_cast<TIFFBuffer*>(handle);
+  auto  count  = std::min(static_cast<size_t>(size),
+      buffer->mData.size() - std::min(buffer->mOffset, buffer->mData.size()));
+  std::memcpy(data, buffer->mData.data() + buffer->mOffset, count);
+  buffer->mOffset += count;
+  return static_cast<tmsize_t>(count);
+}
+
+tmsize_t tiffWrite(thandle_t handle, void* data, tmsize_t size) {
+  auto* buffer = static_cast<TIFFBuffer*>(handle);
+  auto  end    = buffer->mOffset + static_cast<size_t>(size);
+  if (end > buffer->mData.size()) {
+    buffer->mData.resize(end);
+  }
+  std::memcpy(buffer->mData.data() + buffer->mOffset, data, static_cast<size_t>(size));
+  buffer->mOffset = end;
+  return size;
+}
+
+toff_t tiffSeek(thandle_t handle, toff_t offset, int whence) {
+  auto* buffer = static_cast<TIFFBuffer*>(handle);
+  if (whence == SEEK_CUR) {
+    buffer->mOffset += offset;
+  } else if (whence == SEEK_END) {
+    buffer->mOffset = buffer->mData.size() + offset;
+  } else {
+    buffer->mOffset = offset;
+  }
+  return buffer->mOffset;
+}
+
+int tiffClose(thandle_t /*handle*/) {
+  return 0;
+}
+
+toff_t tiffSize(thandle_t handle) {
+  return static_cast<TIFFBuffer*>(handle)->mData.size();
+}
+
+int tiffMap(thandle_t /*handle*/, void** /*base*/, toff_t* /*size*/) {
+  return 0;
+}
+
+void tiffUnmap(thandle_t /*handle*/, void* /*base*/, toff_t /*size*/) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The jpeg writer of stb_image_write calls the write function many times with small chunks of
+// data. Hence, we have to append the data to the vector.
+void appendToVector(void* context, void* data, int len) {
+  auto* vector   = static_cast<std::vector<std::byte>*>(context);
+  auto* charData = static_cast<std::byte*>(data);
+  // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
+  vector->insert(vector->end(), charData, charData + len);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+char const* getContentType(ImageFormat format) {
+  switch (format) {
+  case ImageFormat::eJPEG:
+    return "image/jpeg";
+  case ImageFormat::eQOI:
+    return "image/qoi";
+  case ImageFormat::eRaw:
+    return "application/octet-stream";
+  default:
+    return "image/png";
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::byte> encodePNG(
+    std::byte const* pixels, int32_t width, int32_t height, int32_t level, uint32_t threadCount) {
+
+  // All chunks before the image data have a fixed size. These are the signature and the IHDR chunk
+  // with eight bits per channel, RGB, no interlacing.
+  const size_t headerSize = 8 + (12 + 13);
+
+  auto writeHeader = [width, height](std::byte*& out) {
+    const std::array<uint8_t, 8> signature{137, 80, 78, 71, 13, 10, 26, 10};
+    writeBytes(out, signature.data(), signature.size());
+
+    std::array<std::byte, 13> header{};
+    auto*                     headerOut = header.data();
+    writeBigEndian(headerOut, static_cast<uint32_t>(width));
+    writeBigEndian(headerOut, static_cast<uint32_t>(height));
+    header[8] = std::byte{8};
+    header[9] = std::byte{2};
+    writeChunk(out, "IHDR", header.data(), header.size());
+  };
+
+  size_t stride     = static_cast<size_t>(width) * 3;
+  auto   stripCount = getStripCount(height, threadCount);
+
+  // Without compression, filtering is pointless, so the rows are just flipped and copied. Each row
+  // is preceded by its filter type. The stored stream is written in place into a single IDAT
+  // chunk, so that it does not need another buffer.
+  if (level <= 0) {
+    std::vector<std::byte> rows((stride + 1) * height);
+
+    forEachStrip(height, stripCount, [&](uint32_t /*strip*/, int32_t begin, int32_t end) {
+      for (int32_t y(begin); y < end; ++y) {
+        auto* out = rows.data() + y * (stride + 1);
+        out[0]    = std::byte{0};
+        std::memcpy(out + 1, pixels + (height - 1 - y) * stride, stride);
+      }
+    });
+
+    size_t                 idatSize = getStoredStreamSize(rows.size());
+    std::vector<std::byte> result(headerSize + (12 + idatSize) + 12);
+    auto*                  out = result.data();
+
+    writeHeader(out);
+
+    writeBigEndian(out, static_cast<uint32_t>(idatSize));
+    auto* idatStart = out;
+    writeBytes(out, "IDAT", 4);
+    writeStoredStream(out, rows.data(), rows.size());
+    writeBigEndian(out, computeCRC(idatStart, idatSize + 4));
+
+    writeChunk(out, "IEND", nullptr, 0);
+
+    return result;
+  }
+
+  // Otherwise, each strip is filtered and compressed independently with the zlib implementation of
+  // stb_image_write. The deflate blocks of all strips are then joined into a single zlib stream,
+  // see compressPNGStrip(). Each strip is written to its own IDAT chunk, which is allowed as
+  // decoders concatenate the data of all IDAT chunks. This way, the copies from the buffers
+  // allocated by stb_image_write and the CRCs of the chunks can be computed in parallel as well.
+  std::vector<std::byte> filtered((stride + 1) * height);
+  std::vector<PNGStrip>  strips(stripCount);
+  std::atomic<bool>      failed{false};
+
+  forEachStrip(height, stripCount, [&](uint32_t strip, int32_t begin, int32_t end) {
+    filterRows(pixels, width, height, begin, end, filtered);
+
+    auto* data = filtered.data() + begin * (stride + 1);
+    if (!compressPNGStrip(data, (end - begin) * (stride + 1), level, strip + 1 == stripCount,
+            strips[strip])) {
+      failed = true;
+    }
+  });
+
+  if (failed) {
+    return {};
+  }
+
+  // The first chunk also contains the zlib header, the last one the checksum of all strips.
+  std::vector<size_t> chunkSizes(stripCount);
+  uint32_t            adler = 1;
+  size_t              size  = headerSize + 12;
+
+  for (uint32_t i(0); i < stripCount; ++i) {
+    chunkSizes[i] = strips[i].mSize + strips[i].mFlushSize;
+    adler         = combineAdler(adler, strips[i].mAdler, strips[i].mLength);
+    size += 12 + chunkSizes[i];
+  }
+
+  chunkSizes.front() += 2;
+  chunkSizes.back() += 4;
+  size += 6;
+
+  std::vector<std::byte> result(size);
+  auto*                  out = result.data();
+
+  writeHeader(out);
+
+  std::vector<std::byte*> chunks(stripCount);
+  for (uint32_t i(0); i < stripCount; ++i) {
+    chunks[i] = out;
+    out += 12 + chunkSizes[i];
+  }
+
+  forEachStrip(height, stripCount, [&](uint32_t strip, int32_t /*begin*/, int32_t /*end*/) {
+    auto*       chunkOut = chunks[strip];
+    auto const& data     = strips[strip];
+
+    writeBigEndian(chunkOut, static_cast<uint32_t>(chunkSizes[strip]));
+    auto* chunkStart = chunkOut;
+    writeBytes(chunkOut, "IDAT", 4);
+
+    // Like stb_image_write, we use the deflate method with a window of 32 KiB.
+    if (strip == 0) {
+      const std::array<uint8_t, 2> zlibHeader{0x78, 0x5e};
+      writeBytes(chunkOut, zlibHeader.data(), zlibHeader.size());
+    }
+
+    writeBytes(chunkOut, data.mData, data.mSize);
+
+    if (data.mFlushSize > 0) {
+      writeFlush(chunkOut, data.mFlushSize);
+    }
+
+    if (strip + 1 == stripCount) {
+      writeBigEndian(chunkOut, adler);
+    }
+
+    writeBigEndian(chunkOut, computeCRC(chunkStart, chunkSizes[strip] + 4));
+  });
+
+  writeChunk(out, "IEND", nullptr, 0);
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::byte> encodeJPEG(
+    std::byte const* pixels, int32_t width, int32_t height, int32_t quality) {
+
+  // The jpeg writer does not support custom strides, so we have to flip the rows ourselves. The
+  // global flip flag of stb_image_write cannot be used, as it is shared by all threads.
+  size_t                 stride = static_cast<size_t>(width) * 3;
+  std::vector<std::byte> flipped(stride * height);
+  for (int32_t y(0); y < height; ++y) {
+    std::memcpy(flipped.data() + y * stride, pixels + (height - 1 - y) * stride, stride);
+  }
+
+  // We reserve some memory in advance so that there are not too many reallocations.
+  std::vector<std::byte> result;
+  result.reserve(flipped.size() / 8);
+
+  stbi_write_jpg_to_func(&appendToVector, &result, width, height, 3, flipped.data(), quality);
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::byte> encodeQOI(
+    std::byte const* pixels, int32_t width, int32_t height, uint32_t threadCount) {
+
+  auto                                stripCount = getStripCount(height, threadCount);
+  std::vector<std::vector<std::byte>> strips(stripCount);
+
+  forEachStrip(height, stripCount, [&](uint32_t strip, int32_t begin, int32_t end) {
+    strips[strip] = encodeQOIStrip(pixels, width, height, begin, end);
+  });
+
+  // The output consists of a header of 14 bytes, the chunks of all strips and an end marker of 8
+  // bytes.
+  size_t size = 14 + 8;
+  for (auto const& strip : strips) {
+    size += strip.size();
+  }
+
+  std::vector<std::byte> result(size);
+  auto*                  out = result.data();
+
+  // The header contains the size, the number of channels and the sRGB color space.
+  writeBytes(out, "qoif", 4);
+  writeBigEndian(out, static_cast<uint32_t>(width));
+  writeBigEndian(out, static_cast<uint32_t>(height));
+  *out++ = std::byte{3};
+  *out++ = std::byte{0};
+
+  for (auto const& strip : strips) {
+    writeBytes(out, strip.data(), strip.size());
+  }
+
+  const std::array<uint8_t, 8> endMarker{0, 0, 0, 0, 0, 0, 0, 1};
+  writeBytes(out, endMarker.data(), endMarker.size());
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::byte> encodeRaw(
+    std::byte const* pixels, int32_t width, int32_t height, uint32_t threadCount) {
+
+  size_t                 stride = static_cast<size_t>(width) * 3;
+  std::vector<std::byte> result(16 + stride * height);
+  auto*                  out = result.data();
+
+  writeBytes(out, "CSRW", 4);
+  writeLittleEndian(out, static_cast<uint32_t>(width));
+  writeLittleEndian(out, static_cast<uint32_t>(height));
+  writeLittleEndian(out, 3);
+
+  forEachStrip(height, getStripCount(height, threadCount),
+      [&](uint32_t /*strip*/, int32_t begin, int32_t end) {
+        for (int32_t y(begin); y < end; ++y) {
+          std::memcpy(out + y * stride, pixels + (height - 1 - y) * stride, stride);
+        }
+      });
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::byte> encodeDepthTIFF(std::byte const* pixels, int32_t width, int32_t height,
+    float scale, DepthFormat format, TIFFCompression compression, float maxDepth) {
+
+  size_t bytesPerSample = format == DepthFormat::eFloat32 ? sizeof(float) : sizeof(uint16_t);
+  size_t rowSize        = static_cast<size_t>(width) * bytesPerSample;
+
+  // Uncompressed images need a bit more than the size of the samples. The remaining bytes are
+  // for the header and the directory.
+  TIFFBuffer buffer;
+  buffer.mData.reserve(rowSize * height + 4096);
+
+  TIFF* out = TIFFClientOpen("MemTIFF", "w", &buffer, &tiffRead, &tiffWrite, &tiffSeek, &tiffClose,
+      &tiffSize, &tiffMap, &tiffUnmap);
+
+  if (!out) {
+    return {};
+  }
+
+  TIFFSetField(out, TIFFTAG_IMAGEWIDTH, width);
+  TIFFSetField(out, TIFFTAG_IMAGELENGTH, height);
+  TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, static_cast<int>(bytesPerSample * 8));
+  TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+  TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, DEPTH_ROWS_PER_STRIP);
+  TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField(out, TIFFTAG_SAMPLEFORMAT,
+      format == DepthFormat::eFixed16 ? SAMPLEFORMAT_UINT : SAMPLEFORMAT_IEEEFP);
+
+  if (format == DepthFormat::eFixed16) {
+    std::array<char, 64> description{};
+    std::snprintf(description.data(), description.size(), "{\"metersPerUnit\": %.9g}",
+        static_cast<double>(maxDepth) / 65535.0);
+    TIFFSetField(out, TIFFTAG_IMAGEDESCRIPTION, description.data());
+  }
+
+  int codec = COMPRESSION_NONE;
+  if (compression == TIFFCompression::eDeflate) {
+    codec = COMPRESSION_ADOBE_DEFLATE;
+  } else if (compression == TIFFCompression::eLZW) {
+    codec = COMPRESSION_LZW;
+  }
+
+  if (codec != COMPRESSION_NONE && TIFFIsCODECConfigured(static_cast<uint16_t>(codec))) {
+    TIFFSetField(out, TIFFTAG_COMPRESSION, codec);
+    TIFFSetField(out, TIFFTAG_PREDICTOR,
+        format == DepthFormat::eFixed16 ? PREDICTOR_HORIZONTAL : PREDICTOR_FLOATINGPOINT);
+  } else {
+    TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  }
+
+  // Each strip is scaled, flipped and converted in one pass into a small buffer which is then
+  // handed over to libtiff. The predictors modify this buffer in-place.
+  std::vector<std::byte> strip(rowSize * DEPTH_ROWS_PER_STRIP);
+  auto const*            depth  = reinterpret_cast<float const*>(pixels);
+  float                  factor = maxDepth > 0.F ? scale / maxDepth * 65535.F : 0.F;
+
+  for (int32_t firstRow(0); firstRow < height; firstRow += DEPTH_ROWS_PER_STRIP) {
+    int32_t rows = std::min(DEPTH_ROWS_PER_STRIP, height - firstRow);
+
+    for (int32_t i(0); i < rows; ++i) {
+      auto const* in     = depth + static_cast<ptrdiff_t>(height - 1 - firstRow - i) * width;
+      auto*       target = strip.data() + i * rowSize;
+
+      switch (format) {
+      case DepthFormat::eFloat16:
+        scaleRowToHalf(in, reinterpret_cast<uint16_t*>(target), width, scale);
+        break;
+      case DepthFormat::eFixed16:
+        quantizeRow(in, reinterpret_cast<uint16_t*>(target), width, factor);
+        break;
+      default:
+        scaleRow(in, reinterpret_cast<float*>(target), width, scale);
+        break;
+      }
+    }
+
+    auto index = static_cast<uint32_t>(firstRow / DEPTH_ROWS_PER_STRIP);
+    auto size  = static_cast<tmsize_t>(rows * rowSize);
+
+    if (TIFFWriteEncodedStrip(out, index, strip.data(), size) < 0) {
+      TIFFClose(out);
+      return {};
+    }
+  }
+
+  TIFFClose(out);
+
+  return std::move(buffer.mData);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string compressGzip(std::string const& data, int32_t level) {
+  int  compressedSize = 0;
+  auto compressed     = stbi_zlib_compress(
+      reinterpret_cast<unsigned char*>(const_cast<char*>(data.data())),
+      static_cast<int>(data.size()), &compressedSize, std::max(level, MIN_STBI_ZLIB_LEVEL));
+
+  // The zlib stream consists of a two byte header, the deflate data and the Adler-32 checksum.
+  // Only the deflate data is used; gzip uses a different header and a CRC-32 checksum instead.
+  if (!compressed || compressedSize < 6) {
+    std::free(compressed);
+    return {};
+  }
+
+  size_t      deflateSize = static_cast<size_t>(compressedSize) - 6;
+  std::string result(10 + deflateSize + 8, '\0');
+  auto*       out = reinterpret_cast<std::byte*>(result.data());
+
+  // Deflate, no flags, no modification time, unknown operating system.
+  const std::array<uint8_t, 10> header{0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 255};
+  writeBytes(out, header.data(), header.size());
+  writeBytes(out, compressed + 2, deflateSize);
+  std::free(compressed);
+
+  writeLittleEndian(
+      out, computeCRC(reinterpret_cast<std::byte const*>(data.data()), data.size()));
+  writeLittleEndian(out, static_cast<uint32_t>(data.size()));
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
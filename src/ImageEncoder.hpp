@@ -0,0 +1,84 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_IMAGE_ENCODER_HPP
+#define CSP_WEB_API_IMAGE_ENCODER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace csp::webapi {
+
+/// These functions encode pixel data as read by glReadPixels(). This means that the input rows are
+/// stored bottom to top, the encoded images will be flipped accordingly. The input is never
+/// modified, so it can be read directly from a mapped pixel-pack buffer. All functions are
+/// thread-safe and can be called from multiple threads concurrently. Functions which encode strips
+/// in parallel run them on a thread pool shared by all calls, so concurrent encodes do not
+/// oversubscribe the CPU.
+
+/// The formats in which color images can be encoded.
+enum class ImageFormat { ePNG, eJPEG, eQOI, eRaw };
+
+/// Returns the MIME type of images encoded in the given format.
+char const* getContentType(ImageFormat format);
+
+/// The compression level used by stb_image_write, which was used for all PNGs before.
+static const int32_t DEFAULT_PNG_COMPRESSION = 8;
+
+/// Encodes tightly packed RGB pixels as PNG with the given zlib compression level between 0 and
+/// 9. Level 0 stores the pixels without any compression and filtering, which is much faster but
+/// produces large files. The deflate implementation of stb_image_write does not support levels 1
+/// to 4, these behave like level 5. Up to threadCount horizontal strips of the image are filtered
+/// and compressed in parallel. As the strips are compressed independently, the result may be
+/// slightly larger than if the image was compressed as a whole.
+std::vector<std::byte> encodePNG(std::byte const* pixels, int32_t width, int32_t height,
+    int32_t level = DEFAULT_PNG_COMPRESSION, uint32_t threadCount = 1);
+
+/// Encodes tightly packed RGB pixels as JPEG with the given quality between 1 and 100.
+std::vector<std::byte> encodeJPEG(
+    std::byte const* pixels, int32_t width, int32_t height, int32_t quality);
+
+/// Encodes tightly packed RGB pixels in the "Quite OK Image Format" (https://qoiformat.org). Up to
+/// threadCount horizontal strips of the image are encoded in parallel.
+std::vector<std::byte> encodeQOI(
+    std::byte const* pixels, int32_t width, int32_t height, uint32_t threadCount = 1);
+
+/// Stores tightly packed RGB pixels without any compression, with the rows ordered from top to
+/// bottom. They are preceded by a header of 16 bytes: The magic string "CSRW" followed by the
+/// width, the height and the number of channels, each as little-endian 32 bit unsigned integer.
+std::vector<std::byte> encodeRaw(
+    std::byte const* pixels, int32_t width, int32_t height, uint32_t threadCount = 1);
+
+/// The sample formats of depth images. eFloat32 and eFloat16 store the distance in meters. Note
+/// that 16 bit floats cannot represent values larger than 65504, these become infinity. eFixed16
+/// maps the range from zero to a given maximum distance to unsigned 16 bit integers.
+enum class DepthFormat { eFloat32, eFloat16, eFixed16 };
+
+/// The compression methods of TIFF images. Both compressed methods are combined with the
+/// appropriate predictor for the sample format.
+enum class TIFFCompression { eNone, eDeflate, eLZW };
+
+/// Multiplies each depth value with the given scale and encodes the result as a grayscale TIFF
+/// image. Scaling, flipping and conversion to the given format are done in a single pass over the
+/// pixels, strip by strip, and the TIFF is written directly to the returned buffer. For eFixed16,
+/// the value 65535 corresponds to maxDepth meters. In this case, the number of meters per unit is
+/// stored in the ImageDescription tag as JSON, e.g. {"metersPerUnit": 0.5}. If the given
+/// compression is not supported by libtiff, the image is written uncompressed.
+std::vector<std::byte> encodeDepthTIFF(std::byte const* pixels, int32_t width, int32_t height,
+    float scale, DepthFormat format = DepthFormat::eFloat32,
+    TIFFCompression compression = TIFFCompression::eNone, float maxDepth = 1.F);
+
+/// Compresses arbitrary data in the gzip format with the given zlib compression level between 5
+/// and 9; lower levels behave like 5. This is not related to images, but uses the same deflate
+/// implementation as encodePNG(). It is used for the "Content-Encoding: gzip" variants of static
+/// files. Returns an empty string if the compression failed.
+std::string compressGzip(std::string const& data, int32_t level = 9);
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_IMAGE_ENCODER_HPP
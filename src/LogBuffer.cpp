@@ -0,0 +1,165 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "LogBuffer.hpp"
+
+#include <algorithm>
+#include <string_view>
+
+namespace csp::webapi {
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns the length of the given string truncated to at most maxLength bytes. If the string has
+// to be truncated, the cut is moved backwards to the start of a UTF-8 code point, so that no
+// multi-byte sequence is split. Continuation bytes have the bit pattern 10xxxxxx.
+size_t getTruncatedLength(std::string const& string, size_t maxLength) {
+  if (string.size() <= maxLength) {
+    return string.size();
+  }
+
+  size_t length = maxLength;
+  while (length > 0 && (static_cast<unsigned char>(string[length]) & 0xC0U) == 0x80U) {
+    --length;
+  }
+
+  return length;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void to_json(nlohmann::json& j, LogBuffer::Entry const& o) {
+  j = {{"seq", o.mSequence}, {"level", spdlog::level::to_short_c_str(o.mLevel)},
+      {"logger", o.mLogger}, {"message", o.mMessage},
+      {"time",
+          std::chrono::duration_cast<std::chrono::milliseconds>(o.mTime.time_since_epoch())
+              .count()}};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+LogBuffer::LogBuffer(size_t capacity)
+    : mSlots(capacity) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void LogBuffer::add(
+    std::string const& logger, spdlog::level::level_enum level, std::string const& message) {
+  auto time          = std::chrono::system_clock::now();
+  auto loggerLength  = getTruncatedLength(logger, MAX_LOGGER_LENGTH);
+  auto messageLength = getTruncatedLength(message, MAX_MESSAGE_LENGTH);
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  // The message with the sequence number n is stored in the slot n % capacity.
+  ++mLastSequence;
+  auto& slot          = mSlots[mLastSequence % mSlots.size()];
+  slot.mSequence      = mLastSequence;
+  slot.mLevel         = level;
+  slot.mTime          = time;
+  slot.mLoggerLength  = static_cast<uint32_t>(loggerLength);
+  slot.mMessageLength = static_cast<uint32_t>(messageLength);
+  std::copy_n(logger.data(), loggerLength, slot.mLogger.data());
+  std::copy_n(message.data(), messageLength, slot.mMessage.data());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<LogBuffer::Entry> LogBuffer::getSince(uint64_t& cursor, size_t maxCount,
+    spdlog::level::level_enum minLevel, std::string const& loggerFilter) const {
+
+  // The matching slots are copied while the lock is held. The strings are only created afterwards,
+  // so that add() is not blocked by any allocation.
+  uint64_t          capacity = mSlots.size();
+  uint64_t          limit    = std::min(static_cast<uint64_t>(maxCount), capacity);
+  std::vector<Slot> slots;
+  slots.reserve(limit);
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    // Messages which have already been overwritten cannot be returned anymore.
+    uint64_t oldest = mLastSequence - std::min(mLastSequence, capacity);
+    cursor          = std::min(std::max(cursor, oldest), mLastSequence);
+
+    while (cursor < mLastSequence && slots.size() < limit) {
+      ++cursor;
+
+      auto const& slot = mSlots[cursor % capacity];
+
+      if (slot.mLevel < minLevel) {
+        continue;
+      }
+
+      if (!loggerFilter.empty() &&
+          std::string_view(slot.mLogger.data(), slot.mLoggerLength).find(loggerFilter) ==
+              std::string_view::npos) {
+        continue;
+      }
+
+      slots.push_back(slot);
+    }
+  }
+
+  return toEntries(slots);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<LogBuffer::Entry> LogBuffer::getLatest(size_t maxCount) const {
+  uint64_t          capacity = mSlots.size();
+  uint64_t          limit    = std::min(static_cast<uint64_t>(maxCount), capacity);
+  std::vector<Slot> slots;
+  slots.reserve(limit);
+
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    uint64_t count = std::min(limit, mLastSequence);
+
+    for (uint64_t i(0); i < count; ++i) {
+      slots.push_back(mSlots[(mLastSequence - i) % capacity]);
+    }
+  }
+
+  return toEntries(slots);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t LogBuffer::getLastSequence() const {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mLastSequence;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<LogBuffer::Entry> LogBuffer::toEntries(std::vector<Slot> const& slots) {
+  std::vector<Entry> result(slots.size());
+
+  for (size_t i(0); i < slots.size(); ++i) {
+    auto const& slot  = slots[i];
+    auto&       entry = result[i];
+    entry.mSequence   = slot.mSequence;
+    entry.mLevel      = slot.mLevel;
+    entry.mTime       = slot.mTime;
+    entry.mLogger.assign(slot.mLogger.data(), slot.mLoggerLength);
+    entry.mMessage.assign(slot.mMessage.data(), slot.mMessageLength);
+  }
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
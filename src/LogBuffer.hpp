@@ -0,0 +1,91 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_LOG_BUFFER_HPP
+#define CSP_WEB_API_LOG_BUFFER_HPP
+
+#include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace csp::webapi {
+
+/// This class stores the most recent log messages in a ring buffer of fixed capacity. Each message
+/// gets a monotonically increasing sequence number, which allows clients to retrieve only those
+/// messages which they have not seen yet. All methods are thread-safe.
+/// As add() is called for every log message from whichever thread emits it, it does not allocate
+/// any memory: The messages are copied to fixed-size slots which are allocated up-front. Logger
+/// names and messages exceeding the size of a slot are truncated at the start of a UTF-8 code
+/// point, so that valid UTF-8 stays valid.
+class LogBuffer {
+ public:
+  static const size_t MAX_LOGGER_LENGTH  = 64;
+  static const size_t MAX_MESSAGE_LENGTH = 512;
+
+  struct Entry {
+    uint64_t                              mSequence = 0;
+    spdlog::level::level_enum             mLevel    = spdlog::level::info;
+    std::chrono::system_clock::time_point mTime;
+    std::string                           mLogger;
+    std::string                           mMessage;
+  };
+
+  /// All memory for the given number of messages is allocated up-front.
+  explicit LogBuffer(size_t capacity);
+
+  /// Stores a new message. If the buffer is full, the oldest message is overwritten.
+  void add(std::string const& logger, spdlog::level::level_enum level, std::string const& message);
+
+  /// Returns at most maxCount messages with a sequence number larger than the given cursor, oldest
+  /// first. Only messages with at least the given level are returned. If loggerFilter is not
+  /// empty, only messages whose logger name contains the given string are returned. The cursor is
+  /// set to the sequence number of the last examined message, so it can be passed to the next call
+  /// in order to retrieve only new messages.
+  std::vector<Entry> getSince(uint64_t& cursor, size_t maxCount,
+      spdlog::level::level_enum minLevel = spdlog::level::trace,
+      std::string const&        loggerFilter = "") const;
+
+  /// Returns the most recent maxCount messages, newest first.
+  std::vector<Entry> getLatest(size_t maxCount) const;
+
+  /// Returns the sequence number of the most recent message. This is zero if there are no
+  /// messages yet.
+  uint64_t getLastSequence() const;
+
+ private:
+  struct Slot {
+    uint64_t                              mSequence = 0;
+    spdlog::level::level_enum             mLevel    = spdlog::level::info;
+    std::chrono::system_clock::time_point mTime;
+    uint32_t                              mLoggerLength  = 0;
+    uint32_t                              mMessageLength = 0;
+    std::array<char, MAX_LOGGER_LENGTH>   mLogger{};
+    std::array<char, MAX_MESSAGE_LENGTH>  mMessage{};
+  };
+
+  /// Converts copies of slots to entries. This allocates, so it is called without holding mMutex.
+  static std::vector<Entry> toEntries(std::vector<Slot> const& slots);
+
+  mutable std::mutex mMutex;
+
+  // The number of slots never changes after construction, so it can be read without the lock.
+  std::vector<Slot> mSlots;
+  uint64_t           mLastSequence = 0;
+};
+
+/// Converts a log message to a json object with the keys "seq", "level", "logger", "message" and
+/// "time". The time is given in milliseconds since the epoch.
+void to_json(nlohmann::json& j, LogBuffer::Entry const& o);
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_LOG_BUFFER_HPP
@@ -0,0 +1,124 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "Metrics.hpp"
+
+#include <algorithm>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+const std::array<char const*, 11> SECTION_NAMES{"run-js", "save", "load", "patch", "batch",
+    "capture", "stream", "state", "encode", "tasks", "update"};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The boundaries cover everything from short sections of Plugin::update() to slow captures.
+const std::array<double, 16> Metrics::Histogram::BOUNDS{0.0001, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Metrics::Histogram::observe(std::chrono::steady_clock::duration duration) {
+  double seconds = std::chrono::duration<double>(duration).count();
+  size_t bucket  = std::lower_bound(BOUNDS.begin(), BOUNDS.end(), seconds) - BOUNDS.begin();
+
+  mBuckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  mCount.fetch_add(1, std::memory_order_relaxed);
+  mSumNanoseconds.fetch_add(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count(),
+      std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Metrics::Histogram::write(
+    std::ostream& out, std::string const& name, std::string const& labels) const {
+
+  // Prometheus expects cumulative bucket counts.
+  uint64_t count = 0;
+  for (size_t i(0); i < mBuckets.size(); ++i) {
+    count += mBuckets[i].load(std::memory_order_relaxed);
+    out << name << "_bucket{" << labels << ",le=\"";
+    if (i < BOUNDS.size()) {
+      out << BOUNDS[i];
+    } else {
+      out << "+Inf";
+    }
+    out << "\"} " << count << "\n";
+  }
+
+  out << name << "_sum{" << labels << "} "
+      << static_cast<double>(mSumNanoseconds.load(std::memory_order_relaxed)) * 1e-9 << "\n";
+  out << name << "_count{" << labels << "} " << mCount.load(std::memory_order_relaxed) << "\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Metrics::ScopedTimer::ScopedTimer(Histogram& histogram)
+    : mHistogram(histogram)
+    , mStart(std::chrono::steady_clock::now()) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Metrics::ScopedTimer::~ScopedTimer() {
+  mHistogram.observe(std::chrono::steady_clock::now() - mStart);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Metrics::Endpoint& Metrics::addEndpoint(std::string const& name) {
+  auto& endpoint = mEndpoints[name];
+  if (!endpoint) {
+    endpoint = std::make_unique<Endpoint>();
+  }
+  return *endpoint;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Metrics::Histogram& Metrics::getSection(Section section) {
+  return mSections[static_cast<size_t>(section)];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Metrics::write(std::ostream& out) const {
+  out << "# HELP csp_web_api_request_duration_seconds Time spent in the request handlers.\n";
+  out << "# TYPE csp_web_api_request_duration_seconds histogram\n";
+  for (auto const& endpoint : mEndpoints) {
+    endpoint.second->mLatency.write(
+        out, "csp_web_api_request_duration_seconds", "endpoint=\"" + endpoint.first + "\"");
+  }
+
+  out << "# HELP csp_web_api_response_bytes_total Bytes written by the request handlers, not "
+         "counting headers generated by the server.\n";
+  out << "# TYPE csp_web_api_response_bytes_total counter\n";
+  for (auto const& endpoint : mEndpoints) {
+    out << "csp_web_api_response_bytes_total{endpoint=\"" << endpoint.first << "\"} "
+        << endpoint.second->mBytesSent.load(std::memory_order_relaxed) << "\n";
+  }
+
+  out << "# HELP csp_web_api_section_duration_seconds Time spent in the sections of the main "
+         "thread's update and in the encoder threads.\n";
+  out << "# TYPE csp_web_api_section_duration_seconds histogram\n";
+  for (size_t i(0); i < mSections.size(); ++i) {
+    mSections[i].write(out, "csp_web_api_section_duration_seconds",
+        std::string("section=\"") + SECTION_NAMES.at(i) + "\"");
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
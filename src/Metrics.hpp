@@ -0,0 +1,99 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_METRICS_HPP
+#define CSP_WEB_API_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+
+namespace csp::webapi {
+
+/// This class collects the statistics served by the /metrics endpoint. Recording values only uses
+/// relaxed atomic operations, so it can be done from any thread without contention. The endpoints
+/// have to be added before the server is started, as addEndpoint() is not thread-safe.
+class Metrics {
+ public:
+  /// A histogram of durations in seconds with fixed bucket boundaries.
+  class Histogram {
+   public:
+    void observe(std::chrono::steady_clock::duration duration);
+
+    /// Writes the buckets, the sum and the count in the Prometheus text format. The given labels
+    /// are added to each line.
+    void write(std::ostream& out, std::string const& name, std::string const& labels) const;
+
+   private:
+    static const std::array<double, 16> BOUNDS;
+
+    std::array<std::atomic<uint64_t>, 17> mBuckets{};
+    std::atomic<uint64_t>                 mCount{0};
+    std::atomic<uint64_t>                 mSumNanoseconds{0};
+  };
+
+  /// Records the lifetime of the timer in the given histogram.
+  class ScopedTimer {
+   public:
+    explicit ScopedTimer(Histogram& histogram);
+    ~ScopedTimer();
+
+    ScopedTimer(ScopedTimer const& other) = delete;
+    ScopedTimer(ScopedTimer&& other)      = delete;
+
+    ScopedTimer& operator=(ScopedTimer const& other) = delete;
+    ScopedTimer& operator=(ScopedTimer&& other) = delete;
+
+   private:
+    Histogram&                            mHistogram;
+    std::chrono::steady_clock::time_point mStart;
+  };
+
+  struct Endpoint {
+    Histogram             mLatency;
+    std::atomic<uint64_t> mBytesSent{0};
+  };
+
+  /// The sections of the work done by the plugin. All but eEncode are parts of Plugin::update(),
+  /// which is recorded as a whole in eUpdate. eUpdate and eTasks are recorded in every frame, so
+  /// their count is the number of frames. eTasks covers the execution of the tasks posted by the
+  /// server threads and therefore contains eRunJs, eLoad, ePatch and the serialization of eSave.
+  enum class Section {
+    eRunJs,
+    eSave,
+    eLoad,
+    ePatch,
+    eBatch,
+    eCapture,
+    eStream,
+    eState,
+    eEncode,
+    eTasks,
+    eUpdate,
+    eCount
+  };
+
+  /// Returns the statistics of the endpoint with the given name. They are created if necessary.
+  Endpoint& addEndpoint(std::string const& name);
+
+  Histogram& getSection(Section section);
+
+  /// Writes all statistics in the Prometheus text format.
+  void write(std::ostream& out) const;
+
+ private:
+  std::map<std::string, std::unique_ptr<Endpoint>>            mEndpoints;
+  std::array<Histogram, static_cast<size_t>(Section::eCount)> mSections;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_METRICS_HPP
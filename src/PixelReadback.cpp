@@ -0,0 +1,237 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "PixelReadback.hpp"
+
+#include "logger.hpp"
+
+#include <algorithm>
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PixelReadback::Pixels::Pixels(
+    std::byte const* data, size_t size, std::shared_ptr<std::atomic<bool>> released)
+    : mData(data)
+    , mSize(size)
+    , mReleased(std::move(released)) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PixelReadback::Pixels::~Pixels() {
+  if (mReleased) {
+    mReleased->store(true);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::byte const* PixelReadback::Pixels::data() const {
+  return mData;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+size_t PixelReadback::Pixels::size() const {
+  return mSize;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool PixelReadback::Pixels::empty() const {
+  return mSize == 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PixelReadback::PixelReadback(size_t bufferCount)
+    : mBuffers(bufferCount) {
+  for (auto& buffer : mBuffers) {
+    glGenBuffers(1, &buffer.mBuffer);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PixelReadback::~PixelReadback() {
+  for (auto& buffer : mBuffers) {
+    if (buffer.mFence) {
+      glDeleteSync(buffer.mFence);
+    }
+    if (buffer.mReleased) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.mBuffer);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &buffer.mBuffer);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool PixelReadback::read(
+    Format format, int32_t x, int32_t y, int32_t width, int32_t height, Callback callback) {
+  int32_t id = begin(format, width, height);
+
+  if (id < 0) {
+    return false;
+  }
+
+  readRegion(id, x, y, width, height, 0, 0);
+  finish(id, std::move(callback));
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int32_t PixelReadback::begin(Format format, int32_t width, int32_t height) {
+
+  // Find a buffer which is currently not in use.
+  auto buffer = std::find_if(
+      mBuffers.begin(), mBuffers.end(), [](Buffer const& b) { return !b.mReserved; });
+
+  if (buffer == mBuffers.end()) {
+    return -1;
+  }
+
+  size_t bytesPerPixel = format == Format::eRGB ? 3 : sizeof(float);
+  buffer->mSize        = static_cast<size_t>(width) * static_cast<size_t>(height) * bytesPerPixel;
+  buffer->mFormat      = format;
+  buffer->mWidth       = width;
+  buffer->mReserved    = true;
+
+  // Only reallocate the buffer storage if it is too small.
+  if (buffer->mCapacity < buffer->mSize) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer->mBuffer);
+    glBufferData(
+        GL_PIXEL_PACK_BUFFER, static_cast<GLsizeiptr>(buffer->mSize), nullptr, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    buffer->mCapacity = buffer->mSize;
+  }
+
+  return static_cast<int32_t>(std::distance(mBuffers.begin(), buffer));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PixelReadback::readRegion(int32_t id, int32_t x, int32_t y, int32_t width, int32_t height,
+    int32_t targetX, int32_t targetY) {
+  auto& buffer = mBuffers.at(id);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.mBuffer);
+
+  // RGB rows are not necessarily a multiple of four bytes long, so we have to make sure that
+  // OpenGL does not pad them. The row length is set to the width of the entire image, so that the
+  // region is written to the correct position.
+  GLint packAlignment = 0;
+  GLint packRowLength = 0;
+  glGetIntegerv(GL_PACK_ALIGNMENT, &packAlignment);
+  glGetIntegerv(GL_PACK_ROW_LENGTH, &packRowLength);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glPixelStorei(GL_PACK_ROW_LENGTH, buffer.mWidth);
+
+  // As a pixel-pack buffer is bound, the last parameter is an offset into this buffer. This call
+  // returns immediately.
+  size_t bytesPerPixel = buffer.mFormat == Format::eRGB ? 3 : sizeof(float);
+  size_t offset        = (static_cast<size_t>(targetY) * static_cast<size_t>(buffer.mWidth) +
+                       static_cast<size_t>(targetX)) *
+                  bytesPerPixel;
+
+  // NOLINTNEXTLINE(performance-no-int-to-ptr)
+  auto* target = reinterpret_cast<void*>(offset);
+
+  if (buffer.mFormat == Format::eRGB) {
+    glReadPixels(x, y, width, height, GL_RGB, GL_UNSIGNED_BYTE, target);
+  } else {
+    glReadPixels(x, y, width, height, GL_DEPTH_COMPONENT, GL_FLOAT, target);
+  }
+
+  glPixelStorei(GL_PACK_ALIGNMENT, packAlignment);
+  glPixelStorei(GL_PACK_ROW_LENGTH, packRowLength);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PixelReadback::finish(int32_t id, Callback callback) {
+  auto& buffer     = mBuffers.at(id);
+  buffer.mCallback = std::move(callback);
+  buffer.mFence    = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PixelReadback::cancel(int32_t id) {
+  mBuffers.at(id).mReserved = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void PixelReadback::update() {
+  for (auto& buffer : mBuffers) {
+
+    // Once the pixels of a buffer have been released, it can be unmapped and used again.
+    if (buffer.mReleased && buffer.mReleased->load()) {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.mBuffer);
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+      buffer.mReleased.reset();
+      buffer.mReserved = false;
+      continue;
+    }
+
+    if (!buffer.mFence) {
+      continue;
+    }
+
+    // A timeout of zero means that we only query the state of the fence. The flush bit ensures that
+    // the fence actually reaches the GPU.
+    GLenum state = glClientWaitSync(buffer.mFence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+
+    if (state == GL_TIMEOUT_EXPIRED) {
+      continue;
+    }
+
+    glDeleteSync(buffer.mFence);
+    buffer.mFence = nullptr;
+
+    auto pixels = std::make_shared<Pixels const>();
+
+    if (state == GL_WAIT_FAILED) {
+      logger().error("Failed to read pixels: Waiting for the fence failed!");
+    } else {
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, buffer.mBuffer);
+      auto const* mapped = static_cast<std::byte const*>(glMapBufferRange(
+          GL_PIXEL_PACK_BUFFER, 0, static_cast<GLsizeiptr>(buffer.mSize), GL_MAP_READ_BIT));
+
+      // The buffer stays mapped and reserved until the callback has released the pixels.
+      if (mapped) {
+        buffer.mReleased = std::make_shared<std::atomic<bool>>(false);
+        pixels           = std::make_shared<Pixels const>(mapped, buffer.mSize, buffer.mReleased);
+      } else {
+        logger().error("Failed to read pixels: Mapping the pixel-pack buffer failed!");
+      }
+
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    if (!buffer.mReleased) {
+      buffer.mReserved = false;
+    }
+
+    // Move the callback out of the buffer before calling it, as the callback may issue a new read.
+    auto callback = std::move(buffer.mCallback);
+    buffer.mCallback = nullptr;
+    callback(std::move(pixels));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
@@ -0,0 +1,119 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_PIXEL_READBACK_HPP
+#define CSP_WEB_API_PIXEL_READBACK_HPP
+
+#include <GL/glew.h>
+
+#include <cstddef>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace csp::webapi {
+
+/// This class reads pixels from the currently bound read framebuffer without stalling the
+/// graphics pipeline. Instead of calling glReadPixels() into client memory (which forces the CPU to
+/// wait until the GPU has finished rendering), the pixels are read into one of several pixel-pack
+/// buffers and a fence is inserted into the command stream. The buffer is only mapped in a later
+/// call to update() once this fence has been signaled. The callbacks receive a pointer into the
+/// mapped buffer, so that the pixels do not have to be copied on the main thread.
+/// All methods of this class have to be called from the thread which owns the OpenGL context.
+class PixelReadback {
+ public:
+  enum class Format {
+    eRGB,  ///< Three unsigned bytes per pixel.
+    eDepth ///< One float per pixel, containing the depth buffer value.
+  };
+
+  /// The tightly packed pixel data of a completed read, bottom row first. It points directly into
+  /// the mapped pixel-pack buffer. The buffer stays mapped and reserved until the last reference
+  /// to this object has been dropped, which may happen on any thread. It is unmapped in the next
+  /// call to update() afterwards. Hence, the pixels should be released as soon as they have been
+  /// encoded, and all of them have to be released before the PixelReadback is destroyed. If
+  /// reading failed for some reason, the pixels will be empty.
+  class Pixels {
+   public:
+    Pixels() = default;
+    Pixels(std::byte const* data, size_t size, std::shared_ptr<std::atomic<bool>> released);
+    ~Pixels();
+
+    Pixels(Pixels const& other) = delete;
+    Pixels(Pixels&& other)      = delete;
+
+    Pixels& operator=(Pixels const& other) = delete;
+    Pixels& operator=(Pixels&& other) = delete;
+
+    std::byte const* data() const;
+    size_t           size() const;
+    bool             empty() const;
+
+   private:
+    std::byte const*                   mData = nullptr;
+    size_t                             mSize = 0;
+    std::shared_ptr<std::atomic<bool>> mReleased;
+  };
+
+  using Callback = std::function<void(std::shared_ptr<Pixels const>)>;
+
+  /// The given number of pixel-pack buffers is used in a round-robin fashion. This limits the
+  /// number of reads which can be in flight or being encoded at the same time.
+  explicit PixelReadback(size_t bufferCount = 3);
+  ~PixelReadback();
+
+  PixelReadback(PixelReadback const& other) = delete;
+  PixelReadback(PixelReadback&& other)      = delete;
+
+  PixelReadback& operator=(PixelReadback const& other) = delete;
+  PixelReadback& operator=(PixelReadback&& other) = delete;
+
+  /// Issues an asynchronous read of the given region. The callback will be called from a later
+  /// update() once the data is available. If all buffers are currently in use, nothing is done and
+  /// false is returned. You should try again in the next frame in this case.
+  bool read(Format format, int32_t x, int32_t y, int32_t width, int32_t height, Callback callback);
+
+  /// Images can also be assembled from several regions which are read in different frames. For
+  /// this, begin() reserves a buffer for an image of the given size. It returns -1 if all buffers
+  /// are currently in use. Then, readRegion() can be called multiple times to copy a region of the
+  /// current read framebuffer to the given position in the image. Once all regions have been read,
+  /// finish() has to be called. The callback will then be called from a later update().
+  int32_t begin(Format format, int32_t width, int32_t height);
+  void    readRegion(int32_t id, int32_t x, int32_t y, int32_t width, int32_t height,
+         int32_t targetX, int32_t targetY);
+  void    finish(int32_t id, Callback callback);
+
+  /// Releases a buffer reserved with begin() without reading anything.
+  void cancel(int32_t id);
+
+  /// Checks all pending reads without blocking and calls the callbacks of those which have been
+  /// completed by the GPU. Buffers whose pixels have been released are unmapped. This should be
+  /// called once each frame.
+  void update();
+
+ private:
+  struct Buffer {
+    GLuint   mBuffer   = 0;
+    size_t   mCapacity = 0;
+    size_t   mSize     = 0;
+    Format   mFormat   = Format::eRGB;
+    int32_t  mWidth    = 0;
+    bool     mReserved = false;
+    GLsync   mFence    = nullptr;
+    Callback mCallback;
+
+    // This is set while the buffer is mapped. It becomes true once the Pixels have been released.
+    std::shared_ptr<std::atomic<bool>> mReleased;
+  };
+
+  std::vector<Buffer> mBuffers;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_PIXEL_READBACK_HPP
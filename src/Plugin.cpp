@@ -9,9 +9,22 @@
 #include "../../../src/cs-core/GuiManager.hpp"
 #include "../../../src/cs-core/Settings.hpp"
 #include "../../../src/cs-core/SolarSystem.hpp"
+#include "../../../src/cs-core/TimeControl.hpp"
 #include "../../../src/cs-scene/CelestialObserver.hpp"
+#include "../../../src/cs-utils/convert.hpp"
 #include "../../../src/cs-utils/logger.hpp"
 #include "../../../src/cs-utils/utils.hpp"
+#include "Downsampler.hpp"
+#include "EventChannel.hpp"
+#include "FrameStream.hpp"
+#include "ImageEncoder.hpp"
+#include "LogBuffer.hpp"
+#include "Metrics.hpp"
+#include "PixelReadback.hpp"
+#include "StateSnapshot.hpp"
+#include "StaticFileCache.hpp"
+#include "TaskQueue.hpp"
+#include "ThreadPool.hpp"
 #include "logger.hpp"
 
 #include <CivetServer.h>
@@ -22,13 +35,13 @@
 #include <VistaKernel/DisplayManager/VistaWindow.h>
 #include <VistaKernel/VistaFrameLoop.h>
 #include <VistaKernel/VistaSystem.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
 #include <curlpp/cURLpp.hpp>
 #include <sstream>
-#include <tiffio.h>
-#include <tiffio.hxx>
-
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include <stb_image_write.h>
+#include <thread>
 #include <utility>
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -49,51 +62,96 @@ namespace {
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// Converts a void* to a std::vector<std::byte> (which is given through a void* as well). So this is
-// pretty unsafe, but I think it's the only way to make stb_image write to a std::vector<std::byte>.
-void pngWriteToVector(void* context, void* data, int len) {
-  auto* vector   = static_cast<std::vector<std::byte>*>(context);
-  auto* charData = static_cast<std::byte*>(data);
-  // NOLINTNEXTLINE (cppcoreguidelines-pro-bounds-pointer-arithmetic)
-  *vector = std::vector<std::byte>(charData, charData + len);
+// The statistics of the endpoint whose handler is currently executed by this thread. This is used
+// by sendData() to count the bytes sent without any locking.
+thread_local csp::webapi::Metrics::Endpoint* tCurrentEndpoint = nullptr;
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// All data written by the handlers should be sent with this method, so that it is included in the
+// statistics served by the /metrics endpoint.
+int sendData(mg_connection* conn, void const* data, size_t length) {
+  if (tCurrentEndpoint) {
+    tCurrentEndpoint->mBytesSent.fetch_add(length, std::memory_order_relaxed);
+  }
+  return mg_write(conn, data, length);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
-// A simple wrapper class which basically allows registering of lambdas as endpoint handlers for
-// our CivetServer. This one handles GET requests.
-class GetHandler : public CivetHandler {
+// The base class of the handlers below. It calls the given lambda and records the duration of each
+// call in the statistics of the corresponding endpoint.
+class LambdaHandler : public CivetHandler {
  public:
-  explicit GetHandler(std::function<void(mg_connection*)> handler)
+  explicit LambdaHandler(std::function<void(mg_connection*)> handler)
       : mHandler(std::move(handler)) {
   }
 
-  bool handleGet(CivetServer* /*server*/, mg_connection* conn) override {
+  void setMetrics(csp::webapi::Metrics::Endpoint* metrics) {
+    mMetrics = metrics;
+  }
+
+ protected:
+  bool handle(mg_connection* conn) {
+    if (!mMetrics) {
+      mHandler(conn);
+      return true;
+    }
+
+    csp::webapi::Metrics::ScopedTimer timer(mMetrics->mLatency);
+    tCurrentEndpoint = mMetrics;
     mHandler(conn);
+    tCurrentEndpoint = nullptr;
     return true;
   }
 
  private:
   std::function<void(mg_connection*)> mHandler;
+  csp::webapi::Metrics::Endpoint*     mMetrics = nullptr;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 // A simple wrapper class which basically allows registering of lambdas as endpoint handlers for
-// our CivetServer. This one handles POST requests.
-class PostHandler : public CivetHandler {
+// our CivetServer. This one handles GET requests.
+class GetHandler : public LambdaHandler {
  public:
-  explicit PostHandler(std::function<void(mg_connection*)> handler)
-      : mHandler(std::move(handler)) {
+  using LambdaHandler::LambdaHandler;
+
+  bool handleGet(CivetServer* /*server*/, mg_connection* conn) override {
+    return handle(conn);
   }
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A simple wrapper class which basically allows registering of lambdas as endpoint handlers for
+// our CivetServer. This one handles POST requests.
+class PostHandler : public LambdaHandler {
+ public:
+  using LambdaHandler::LambdaHandler;
 
   bool handlePost(CivetServer* /*server*/, mg_connection* conn) override {
-    mHandler(conn);
-    return true;
+    return handle(conn);
   }
+};
 
- private:
-  std::function<void(mg_connection*)> mHandler;
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A simple wrapper class which basically allows registering of lambdas as endpoint handlers for
+// our CivetServer. This one handles PATCH requests. As not all clients support PATCH, POST
+// requests are accepted as well.
+class PatchHandler : public LambdaHandler {
+ public:
+  using LambdaHandler::LambdaHandler;
+
+  bool handlePatch(CivetServer* /*server*/, mg_connection* conn) override {
+    return handle(conn);
+  }
+
+  bool handlePost(CivetServer* /*server*/, mg_connection* conn) override {
+    return handle(conn);
+  }
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -111,6 +169,166 @@ T getParam(mg_connection* conn, std::string const& name, T const& defaultValue)
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
+// Sends an error response which asks the client to retry the request after a second. This is used
+// with the status codes 429 (Too Many Requests) and 503 (Service Unavailable).
+void sendRetryLater(mg_connection* conn, int status, std::string const& message) {
+  char const* reason = status == 429 ? "Too Many Requests" : "Service Unavailable";
+  mg_printf(conn,
+      "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+      "Retry-After: 1\r\n\r\n",
+      status, reason, message.length());
+  sendData(conn, message.data(), message.length());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Reads the body of a POST request. If it is larger than the given size, the request is answered
+// with "413 Payload Too Large" and false is returned.
+bool readBody(mg_connection* conn, size_t maxSize, std::string& body) {
+  if (mg_get_request_info(conn)->content_length > static_cast<long long>(maxSize)) {
+    mg_send_http_error(conn, 413, "The request body must not be larger than %zu bytes.", maxSize);
+    return false;
+  }
+
+  // If no Content-Length is given, we only know the size after reading the body.
+  body = CivetServer::getPostData(conn);
+
+  if (body.size() > maxSize) {
+    mg_send_http_error(conn, 413, "The request body must not be larger than %zu bytes.", maxSize);
+    return false;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns true if the given JSON pointer equals the given prefix or points to one of its children.
+bool isInside(std::string const& pointer, std::string const& prefix) {
+  return pointer.compare(0, prefix.length(), prefix) == 0 &&
+         (pointer.length() == prefix.length() || pointer[prefix.length()] == '/');
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Wraps the given /run-js code so that its result or any thrown error is reported back to the
+// plugin. The code is evaluated with an indirect eval() so that it runs in the global scope, just
+// like code passed directly to executeJavascript().
+std::string wrapJavaScript(uint64_t id, std::string const& code) {
+  auto quotedCode =
+      nlohmann::json(code).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+  auto idString = std::to_string(id);
+
+  return "try {"
+         "  const result = (0, eval)(" + quotedCode + ");"
+         "  CosmoScout.callbacks.webapi.reportResult(" + idString + ", "
+         "      JSON.stringify(result) || '', '');"
+         "} catch (e) {"
+         "  CosmoScout.callbacks.webapi.reportResult(" + idString + ", '', String(e));"
+         "}\n";
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Encodes the given data as base64 in order to embed binary data in JSON responses.
+std::string toBase64(std::vector<std::byte> const& data) {
+  const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  std::string result;
+  result.reserve((data.size() + 2) / 3 * 4);
+
+  for (size_t i(0); i < data.size(); i += 3) {
+    uint32_t chunk = std::to_integer<uint32_t>(data[i]) << 16U;
+    if (i + 1 < data.size()) {
+      chunk |= std::to_integer<uint32_t>(data[i + 1]) << 8U;
+    }
+    if (i + 2 < data.size()) {
+      chunk |= std::to_integer<uint32_t>(data[i + 2]);
+    }
+
+    result.push_back(alphabet[(chunk >> 18U) & 63U]);
+    result.push_back(alphabet[(chunk >> 12U) & 63U]);
+    result.push_back(i + 1 < data.size() ? alphabet[(chunk >> 6U) & 63U] : '=');
+    result.push_back(i + 2 < data.size() ? alphabet[chunk & 63U] : '=');
+  }
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Sends the given file, gzip-compressed if the client supports it. If the client already has the
+// current version of the file, only "304 Not Modified" is sent. Clients have to revalidate their
+// copy each time, so that changes are picked up when the cache is cleared.
+void sendStaticFile(mg_connection* conn, csp::webapi::StaticFileCache::File const& file) {
+  char const* acceptEncoding = mg_get_header(conn, "Accept-Encoding");
+  bool gzip = !file.mGzipData.empty() && acceptEncoding && std::strstr(acceptEncoding, "gzip");
+
+  auto const& data = gzip ? file.mGzipData : file.mData;
+  auto const& etag = gzip ? file.mGzipETag : file.mETag;
+
+  // The header may contain a list of ETags, so we only check whether ours is part of it.
+  char const* ifNoneMatch = mg_get_header(conn, "If-None-Match");
+  if (ifNoneMatch && std::strstr(ifNoneMatch, etag.c_str())) {
+    mg_printf(conn, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nVary: Accept-Encoding\r\n\r\n",
+        etag.c_str());
+    return;
+  }
+
+  mg_printf(conn,
+      "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%sETag: %s\r\n"
+      "Cache-Control: no-cache\r\nVary: Accept-Encoding\r\n\r\n",
+      file.mContentType.c_str(), data.length(), gzip ? "Content-Encoding: gzip\r\n" : "",
+      etag.c_str());
+  sendData(conn, data.data(), data.length());
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Increments the given number of pending requests by count, unless this would exceed the given
+// limit. In this case, false is returned and the number is not changed.
+bool tryReserve(std::atomic<uint32_t>& pending, uint32_t count, uint32_t limit) {
+  if (pending.fetch_add(count) + count > limit) {
+    pending.fetch_sub(count);
+    return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Tar archives consist of blocks of this size.
+const size_t TAR_BLOCK_SIZE = 512;
+
+// Creates the ustar header of a regular file with the given name and size. The name must be
+// shorter than 100 characters.
+std::array<char, TAR_BLOCK_SIZE> createTarHeader(std::string const& name, size_t size) {
+  std::array<char, TAR_BLOCK_SIZE> header{};
+
+  std::snprintf(header.data(), 100, "%s", name.c_str());
+  std::snprintf(header.data() + 100, 8, "%07o", 0644U);
+  std::snprintf(header.data() + 108, 8, "%07o", 0U);
+  std::snprintf(header.data() + 116, 8, "%07o", 0U);
+  std::snprintf(header.data() + 124, 12, "%011llo", static_cast<unsigned long long>(size));
+  std::snprintf(header.data() + 136, 12, "%011llo",
+      static_cast<unsigned long long>(std::max<std::time_t>(0, std::time(nullptr))));
+  header[156] = '0';
+  std::memcpy(header.data() + 257, "ustar", 6);
+  std::memcpy(header.data() + 263, "00", 2);
+
+  // The checksum is computed with the checksum field filled with spaces.
+  std::memset(header.data() + 148, ' ', 8);
+  uint32_t checksum = 0;
+  for (char c : header) {
+    checksum += static_cast<uint8_t>(c);
+  }
+  std::snprintf(header.data() + 148, 7, "%06o", checksum);
+
+  return header;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 } // namespace
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -120,13 +338,39 @@ namespace csp::webapi {
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void from_json(nlohmann::json const& j, Plugin::Settings& o) {
-  cs::core::Settings::deserialize(j, "port", o.mPort);
   cs::core::Settings::deserialize(j, "page", o.mPage);
+  cs::core::Settings::deserialize(j, "staticDirectory", o.mStaticDirectory);
+  cs::core::Settings::deserialize(j, "saveCacheMaxAge", o.mSaveCacheMaxAge);
+  cs::core::Settings::deserialize(j, "maxPendingJavaScript", o.mMaxPendingJavaScript);
+  cs::core::Settings::deserialize(j, "maxPendingPatches", o.mMaxPendingPatches);
+  cs::core::Settings::deserialize(j, "maxPendingCaptures", o.mMaxPendingCaptures);
+  cs::core::Settings::deserialize(j, "maxPendingBatches", o.mMaxPendingBatches);
+  cs::core::Settings::deserialize(j, "maxRequestSize", o.mMaxRequestSize);
+  cs::core::Settings::deserialize(j, "requestTimeout", o.mRequestTimeout);
+  cs::core::Settings::deserialize(j, "serverThreads", o.mServerThreads);
+  cs::core::Settings::deserialize(j, "keepAlive", o.mKeepAlive);
+  cs::core::Settings::deserialize(j, "connectionTimeout", o.mConnectionTimeout);
+  cs::core::Settings::deserialize(j, "listenBacklog", o.mListenBacklog);
+
+  // Changing the port starts the server, so this is done after all server options have been read.
+  cs::core::Settings::deserialize(j, "port", o.mPort);
 }
 
 void to_json(nlohmann::json& j, Plugin::Settings const& o) {
   cs::core::Settings::serialize(j, "port", o.mPort);
   cs::core::Settings::serialize(j, "page", o.mPage);
+  cs::core::Settings::serialize(j, "staticDirectory", o.mStaticDirectory);
+  cs::core::Settings::serialize(j, "saveCacheMaxAge", o.mSaveCacheMaxAge);
+  cs::core::Settings::serialize(j, "maxPendingJavaScript", o.mMaxPendingJavaScript);
+  cs::core::Settings::serialize(j, "maxPendingPatches", o.mMaxPendingPatches);
+  cs::core::Settings::serialize(j, "maxPendingCaptures", o.mMaxPendingCaptures);
+  cs::core::Settings::serialize(j, "maxPendingBatches", o.mMaxPendingBatches);
+  cs::core::Settings::serialize(j, "maxRequestSize", o.mMaxRequestSize);
+  cs::core::Settings::serialize(j, "requestTimeout", o.mRequestTimeout);
+  cs::core::Settings::serialize(j, "serverThreads", o.mServerThreads);
+  cs::core::Settings::serialize(j, "keepAlive", o.mKeepAlive);
+  cs::core::Settings::serialize(j, "connectionTimeout", o.mConnectionTimeout);
+  cs::core::Settings::serialize(j, "listenBacklog", o.mListenBacklog);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -135,317 +379,1912 @@ void Plugin::init() {
 
   logger().info("Loading plugin...");
 
-  // We store all emitted log messages (up to a maximum of 1000) in a std::deque in order to be able
-  // to answer to /log requests.
+  mMetrics       = std::make_unique<Metrics>();
+  mStateSnapshot = std::make_unique<StateSnapshot>();
+  mPixelReadback = std::make_unique<PixelReadback>();
+  mDownsampler   = std::make_unique<Downsampler>();
+  mStaticFiles   = std::make_unique<StaticFileCache>(MAX_STATIC_CACHE_SIZE);
+  mTasks         = std::make_unique<TaskQueue>();
+  mEncoderPool   = std::make_unique<ThreadPool>(2);
+  mJpegStream    = std::make_unique<FrameStream>();
+  mPngStream     = std::make_unique<FrameStream>();
+
+  // We store all emitted log messages (up to a maximum of 1000) in a ring buffer in order to be
+  // able to answer to /log requests.
+  mLogBuffer = std::make_unique<LogBuffer>(1000);
+
   mOnLogMessageConnection = cs::utils::onLogMessage().connect(
       [this](
           std::string const& logger, spdlog::level::level_enum level, std::string const& message) {
-        const std::unordered_map<spdlog::level::level_enum, std::string> mapping = {
-            {spdlog::level::trace, "T"}, {spdlog::level::debug, "D"}, {spdlog::level::info, "I"},
-            {spdlog::level::warn, "W"}, {spdlog::level::err, "E"}, {spdlog::level::critical, "C"}};
-
-        std::lock_guard<std::mutex> lock(mLogMutex);
-        mLogMessages.push_front("[" + mapping.at(level) + "] " + logger + message);
-
-        if (mLogMessages.size() > 1000) {
-          mLogMessages.pop_back();
-        }
+        mLogBuffer->add(logger, level, message);
       });
 
-  // Return the landing page when the root document is requested. If not landing page is configured,
-  // we just send back a simple message.
+  // Clients connected to the /events endpoint are notified about new log messages, settings changes
+  // and finished captures.
+  mEventChannel = std::make_unique<EventChannel>(*mLogBuffer);
+
+  // Return the landing page when the root document is requested. All other requests which do not
+  // match an endpoint are served from the static directory, if one is configured. Else they get
+  // the landing page as well. If neither is configured, we just send back a simple message. The
+  // files are served from memory after they have been requested once.
   mHandlers.emplace("/", std::make_unique<GetHandler>([this](mg_connection* conn) {
-    if (mPluginSettings.mPage) {
-      mg_send_mime_file(conn, mPluginSettings.mPage.value().c_str(), "text/html");
-    } else {
+    if (!mStaticFiles->hasSources()) {
       std::string response = "CosmoScout VR is running. You can modify this page with "
                              "the 'page' key in the configuration of 'csp-web-api'.";
       mg_send_http_ok(conn, "text/plain", response.length());
-      mg_write(conn, response.data(), response.length());
+      sendData(conn, response.data(), response.length());
+      return;
     }
+
+    auto path = mStaticFiles->getPath(mg_get_request_info(conn)->local_uri);
+    auto file = path ? mStaticFiles->get(path.value()) : nullptr;
+    if (!file) {
+      mg_send_http_error(conn, 404, "File not found.");
+      return;
+    }
+
+    sendStaticFile(conn, *file);
   }));
 
-  // Return a json array of log messages for /log requests.
+  // Return a json array of log messages for /log requests. If the "since" parameter is given, only
+  // messages which have been logged after the message with the given sequence number are returned.
+  // In this case, the messages are returned as objects together with their sequence number, so
+  // that clients can continue from there in their next request.
   mHandlers.emplace("/log", std::make_unique<GetHandler>([this](mg_connection* conn) {
     auto           length = getParam<uint32_t>(conn, "length", 100U);
     nlohmann::json json;
 
-    {
-      std::lock_guard<std::mutex> lock(mLogMutex);
-      auto                        it = mLogMessages.begin();
-      while (json.size() < length && it != mLogMessages.end()) {
-        json.push_back(*it);
-        ++it;
+    std::string since;
+    if (CivetServer::getParam(conn, "since", since)) {
+      // spdlog returns "off" for unknown level names, which would silently omit all messages.
+      auto levelName = getParam<std::string>(conn, "level", "trace");
+      auto level     = spdlog::level::from_str(levelName);
+      if (level == spdlog::level::off && levelName != "off") {
+        mg_send_http_error(conn, 400, "Unknown log level '%s'.", levelName.c_str());
+        return;
+      }
+
+      auto cursor   = cs::utils::fromString<uint64_t>(since);
+      auto logger   = getParam<std::string>(conn, "logger", "");
+      auto messages = mLogBuffer->getSince(cursor, length, level, logger);
+
+      json["last"]     = cursor;
+      json["messages"] = messages;
+
+    } else {
+      json = nlohmann::json::array();
+
+      for (auto const& m : mLogBuffer->getLatest(length)) {
+        json.push_back("[" + std::string(spdlog::level::to_short_c_str(m.mLevel)) + "] " +
+                       m.mLogger + m.mMessage);
       }
     }
 
-    std::string response = json.dump();
+    // Log messages may contain arbitrary bytes, invalid UTF-8 sequences are replaced.
+    std::string response = json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
     mg_send_http_ok(conn, "application/json", response.length());
-    mg_write(conn, response.data(), response.length());
+    sendData(conn, response.data(), response.length());
   }));
 
   // Return a json object containing the current scene settings.
   mHandlers.emplace("/save", std::make_unique<GetHandler>([this](mg_connection* conn) {
-    // This string will contain the json data at the end of this method.
-    std::string response;
-    {
-      std::unique_lock<std::mutex> lock(mSaveMutex);
+    std::shared_ptr<SavedSettings const> saved;
+
+    // If nothing has changed since the last request and no previously received request which
+    // modifies the settings is still pending, we can use the cached settings. The main thread
+    // invalidates the cache before it decrements the counter, so the counter has to be read first.
+    if (mPending.mModifications == 0 && mSaveCacheValid) {
+      std::lock_guard<std::mutex> lock(mSaveMutex);
+      saved = mSaveCache;
+    }
+
+    // Else we have to ask the main thread to serialize the settings. This happens after all
+    // previously received requests have been applied, including the /run-js calls which have only
+    // been collected so far. If several requests wait at the same time, only the first one
+    // serializes the settings, the others get the cached result.
+    if (!saved) {
+      auto result = mTasks->submit([this]() {
+        logger().debug("Executing '/save' request.");
+        executePendingJavaScript();
+        return saveSettings();
+      });
 
-      // This tells the main thread that a save request is pending.
-      mSaveRequested = true;
+      if (result.wait_for(getRequestTimeout()) == std::future_status::timeout) {
+        sendRetryLater(conn, 503, "Timeout while waiting for the settings.");
+        return;
+      }
+
+      try {
+        saved = result.get();
+      } catch (std::future_error const&) {
+        mg_send_http_error(conn, 503, "%s", "The request has been cancelled.");
+        return;
+      }
+    }
+
+    if (saved->mSettings.empty()) {
+      mg_send_http_error(conn, 500, "%s", "Failed to write the settings.");
+      return;
+    }
 
-      // Now we use a condition variable to wait for the save data. It is actually saved in the
-      // Plugin::update() method further below.
-      mSaveDone.wait(lock);
+    std::string const& response = saved->mSettings;
+    std::string const& etag     = saved->mETag;
 
-      response = mSaveSettings;
+    // If the client already has the current settings, there is no need to send them again.
+    char const* ifNoneMatch = mg_get_header(conn, "If-None-Match");
+    if (ifNoneMatch && etag == ifNoneMatch) {
+      mg_printf(conn, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag.c_str());
+      return;
     }
 
-    mg_send_http_ok(conn, "application/json", response.length());
-    mg_write(conn, response.data(), response.length());
+    mg_printf(conn,
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+        "ETag: %s\r\nCache-Control: no-cache\r\n\r\n",
+        response.length(), etag.c_str());
+    sendData(conn, response.data(), response.length());
   }));
 
-  // Allows uploading of the current scene settings.
   mHandlers.emplace("/load", std::make_unique<PostHandler>([this](mg_connection* conn) {
-    std::lock_guard<std::mutex> lock(mLoadMutex);
-    mLoadSettings = CivetServer::getPostData(conn);
+    std::string settings;
+    if (!readBody(conn, mLimits.mMaxRequestSize, settings)) {
+      return;
+    }
+
+    // The settings are loaded by the main thread after all previously received requests. If the
+    // last queued task is a pending /load, its settings are replaced by these ones, as they would
+    // be overwritten right away anyway. If any other task has been queued after it, a new task is
+    // posted, so that this task still sees the settings of the previous /load. The other tasks are
+    // limited, so this bounds the number of queued loads as well.
+    {
+      std::lock_guard<std::mutex> lock(mLoadMutex);
+
+      if (mLoadSettings && mTasks->isLast(mLoadTask)) {
+        *mLoadSettings = std::move(settings);
+      } else {
+        auto slot     = std::make_shared<std::string>(std::move(settings));
+        mLoadSettings = slot;
+        ++mPending.mModifications;
+
+        mLoadTask = mTasks->post([this, slot]() {
+          Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eLoad));
+          logger().debug("Executing '/load' request.");
+
+          std::string settings;
+          {
+            std::lock_guard<std::mutex> lock(mLoadMutex);
+            settings = std::move(*slot);
+            if (mLoadSettings == slot) {
+              mLoadSettings.reset();
+            }
+          }
+
+          executePendingJavaScript();
+          try {
+            mAllSettings->loadFromJson(settings);
+          } catch (std::exception const& e) {
+            logger().error("Failed to read settings: {}", e.what());
+            invalidateSaveCache();
+          }
+
+          --mPending.mModifications;
+        });
+      }
+    }
 
     std::string response = "Done.\r\n";
     mg_send_http_ok(conn, "text/plain", response.length());
-    mg_write(conn, response.data(), response.length());
+    sendData(conn, response.data(), response.length());
+  }));
+
+  // Queue incoming /patch requests. Only the settings which are actually changed by the patch are
+  // applied in the Plugin::update() method further below.
+  mHandlers.emplace("/patch", std::make_unique<PatchHandler>([this](mg_connection* conn) {
+    SettingsPatch patch;
+
+    char const* contentType = mg_get_header(conn, "Content-Type");
+    patch.mJsonPatch =
+        contentType && std::string(contentType).find("application/json-patch+json") == 0;
+
+    std::string body;
+    if (!readBody(conn, mLimits.mMaxRequestSize, body)) {
+      return;
+    }
+
+    patch.mData = nlohmann::json::parse(body, nullptr, false);
+
+    if (patch.mData.is_discarded() || (patch.mJsonPatch && !patch.mData.is_array())) {
+      mg_send_http_error(conn, 400, "%s", "Invalid patch.");
+      return;
+    }
+
+    if (!tryReserve(mPending.mPatches, 1, mLimits.mMaxPendingPatches)) {
+      sendRetryLater(conn, 429, "Too many pending patches.");
+      return;
+    }
+
+    ++mPending.mModifications;
+    mTasks->post([this, patch = std::move(patch)]() {
+      Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::ePatch));
+      logger().debug("Executing '/patch' request.");
+      --mPending.mPatches;
+      executePendingJavaScript();
+      applyPatch(patch);
+      --mPending.mModifications;
+    });
+
+    std::string response = "Done.\r\n";
+    mg_send_http_ok(conn, "text/plain", response.length());
+    sendData(conn, response.data(), response.length());
   }));
 
   // The /capture endpoint is a little bit more involved. As it takes several frames for the
   // capture to be completed (first we have to resize CosmoScout's window to the requested size,
   // then we have to wait some frames so that everything is loaded properly), we have to do some
-  // more synchronization here.
+  // more synchronization here. Each request creates a job which is processed by the main thread.
   mHandlers.emplace("/capture", std::make_unique<GetHandler>([this](mg_connection* conn) {
-    // First acquire the lock to make sure the mCapture* members are not currently read by the
-    // main thread.
-    std::unique_lock<std::mutex> lock(mCaptureMutex);
+    auto job       = std::make_shared<CaptureJob>();
+    job->mSettings = readCaptureSettings(
+        [conn](std::string const& name, std::string const& fallback) {
+          return getParam<std::string>(conn, name, fallback);
+        });
+
+    auto settings = job->mSettings;
+    auto result   = job->mResult.get_future();
+
+    // The job is only owned by the main thread. This way, the promise is broken as soon as the
+    // main thread drops the job, for example when the plugin is unloaded.
+    std::weak_ptr<CaptureJob> weakJob = job;
+
+    if (!tryReserve(mPending.mCaptures, 1, mLimits.mMaxPendingCaptures)) {
+      sendRetryLater(conn, 429, "Too many pending captures.");
+      return;
+    }
+
+    // This tells the main thread that a capture request is pending. The job is added to the
+    // capture queue after all previously received requests have been applied.
+    mTasks->post([this, job = std::move(job)]() { mCaptureJobs.push_back(job); });
 
-    // Read all paramters.
-    mCaptureDelay  = std::clamp(getParam<int32_t>(conn, "delay", 50), 1, 200);
-    mCaptureWidth  = std::clamp(getParam<int32_t>(conn, "width", 800), 10, 2000);
-    mCaptureHeight = std::clamp(getParam<int32_t>(conn, "height", 600), 10, 2000);
-    mCaptureGui    = getParam<std::string>(conn, "gui", "false") == "true";
-    mCaptureDepth  = getParam<std::string>(conn, "depth", "false") == "true";
+    // Now we wait for the capture. It is actually captured in the Plugin::update() method further
+    // below. If it takes too long, the job is cancelled, so that the main thread drops it if it
+    // has not been started yet.
+    auto status = result.wait_for(getRequestTimeout());
+    --mPending.mCaptures;
 
-    // This tells the main thread that a capture request is pending.
-    mCaptureRequested = true;
+    if (status == std::future_status::timeout) {
+      if (auto pending = weakJob.lock()) {
+        pending->mCancelled = true;
+      }
+      sendRetryLater(conn, 503, "Timeout while waiting for the capture.");
+      return;
+    }
 
-    // Now we use a condition variable to wait for the capture. It is actually captured in the
-    // Plugin::update() method further below.
-    mCaptureDone.wait(lock);
+    std::shared_ptr<std::vector<std::byte> const> capture;
 
-    // The capture has been captured, return the result!
-    if (mCaptureDepth) {
-      mg_send_http_ok(conn, "image/tiff", mCapture.size());
-    } else {
-      mg_send_http_ok(conn, "image/png", mCapture.size());
+    try {
+      capture = result.get();
+    } catch (std::future_error const&) {
+      mg_send_http_error(conn, 503, "%s", "The capture has been cancelled.");
+      return;
     }
-    mg_write(conn, mCapture.data(), mCapture.size());
-  }));
 
-  // All POST requests received on /run-js are stored in a queue. They are executed in the main
-  // thread in the Plugin::update() method further below.
-  mHandlers.emplace("/run-js", std::make_unique<PostHandler>([this](mg_connection* conn) {
-    std::lock_guard<std::mutex> lock(mJavaScriptCallsMutex);
-    mJavaScriptCalls.push(CivetServer::getPostData(conn));
+    if (!capture || capture->empty()) {
+      mg_send_http_error(conn, 500, "%s", "Failed to capture the image.");
+      return;
+    }
 
-    std::string response = "Done.\r\n";
-    mg_send_http_ok(conn, "text/plain", response.length());
-    mg_write(conn, response.data(), response.length());
+    // The capture has been captured, return the result!
+    mg_send_http_ok(conn, settings.getContentType(), static_cast<long long>(capture->size()));
+    sendData(conn, capture->data(), capture->size());
   }));
 
-  mOnLoadConnection = mAllSettings->onLoad().connect([this]() { mReloadRequired = true; });
-  mOnSaveConnection = mAllSettings->onSave().connect(
-      [this]() { mAllSettings->mPlugins["csp-web-api"] = mPluginSettings; });
+  // The /capture-sequence endpoint captures a series of frames while the simulation time advances
+  // by a fixed step from frame to frame. Optionally, the observer follows a path given as a JSON
+  // array of keyframes in the request body. The frames are sent as a tar archive while the
+  // remaining frames are still being rendered and encoded. As the response has to be started
+  // before all frames are available, a failure after the first frame truncates the archive.
+  mHandlers.emplace("/capture-sequence", std::make_unique<PostHandler>([this](mg_connection* conn) {
+    std::string body;
+    if (!readBody(conn, mLimits.mMaxRequestSize, body)) {
+      return;
+    }
 
-  // Restart the server if the port changes.
-  mPluginSettings.mPort.connect([this](uint16_t port) { startServer(port); });
+    // Only one sequence can run at a time. The flag is claimed before anything is prepared, so
+    // that rejected requests do not allocate any frames.
+    if (mSequenceRunning.exchange(true)) {
+      sendRetryLater(conn, 429, "Another capture sequence is running.");
+      return;
+    }
 
-  logger().info("Loading done.");
-}
+    auto frameCount = std::clamp(getParam<int32_t>(conn, "frames", 1), 1, MAX_SEQUENCE_FRAMES);
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+    auto sequence       = std::make_shared<SequenceJob>();
+    sequence->mSettings = readCaptureSettings(
+        [conn](std::string const& name, std::string const& fallback) {
+          return getParam<std::string>(conn, name, fallback);
+        });
+    sequence->mSettleFrames = std::clamp(getParam<int32_t>(conn, "settle", 1), 1, 200);
+    sequence->mTimeStep     = getParam<double>(conn, "timeStep", 0.0);
+    sequence->mFrameCount   = frameCount;
 
-void Plugin::deInit() {
-  logger().info("Unloading plugin...");
+    if (!body.empty()) {
+      try {
+        for (auto const& k : nlohmann::json::parse(body)) {
+          SequenceKeyframe keyframe;
+          keyframe.mCenterName = k.value("center", "");
+          keyframe.mFrameName  = k.value("frame", "");
+          keyframe.mPosition   = k.at("position").get<glm::dvec3>();
+          keyframe.mRotation   = k.at("rotation").get<glm::dquat>();
+          sequence->mPath.push_back(std::move(keyframe));
+        }
+      } catch (std::exception const& e) {
+        mSequenceRunning = false;
+        mg_send_http_error(conn, 400, "Invalid observer path: %s", e.what());
+        return;
+      }
+    }
 
-  mAllSettings->onLoad().disconnect(mOnLoadConnection);
-  mAllSettings->onSave().disconnect(mOnSaveConnection);
-  cs::utils::onLogMessage().disconnect(mOnLogMessageConnection);
+    // Only MAX_SEQUENCE_FRAMES_AHEAD frames are requested up front. Whenever a frame has been sent,
+    // the next one is requested, so the encoded frames do not pile up in memory if the client is
+    // slow, and long sequences do not allocate all of their jobs at once.
+    auto settings = sequence->mSettings;
 
-  quitServer();
+    std::deque<std::future<std::shared_ptr<std::vector<std::byte> const>>> results;
 
-  logger().info("Unloading done.");
-}
+    auto requestFrame = [&settings, &results]() {
+      auto job       = std::make_shared<CaptureJob>();
+      job->mSettings = settings;
+      results.push_back(job->mResult.get_future());
+      return job;
+    };
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+    int32_t requested = std::min(frameCount, MAX_SEQUENCE_FRAMES_AHEAD);
+    for (int32_t i(0); i < requested; ++i) {
+      sequence->mFrames.push_back(requestFrame());
+    }
 
-void Plugin::update() {
+    // Like the jobs of /capture, the sequence and its frames are only owned by the main thread, so
+    // all remaining frames fail as soon as the sequence is dropped.
+    auto                       extension    = settings.getFileExtension();
+    std::weak_ptr<SequenceJob> weakSequence = sequence;
+    mTasks->post([this, sequence = std::move(sequence)]() { mSequence = sequence; });
 
-  // Execute all /run-js requests received since the last call to update().
-  {
-    std::lock_guard<std::mutex> lock(mJavaScriptCallsMutex);
-    while (!mJavaScriptCalls.empty()) {
-      auto request = mJavaScriptCalls.front();
-      mJavaScriptCalls.pop();
-      logger().debug("Executing '/run-js' request: '{}'", request);
-      mGuiManager->getGui()->executeJavascript(request);
+    // Stops the main thread from rendering further frames.
+    auto cancel = [&weakSequence]() {
+      if (auto running = weakSequence.lock()) {
+        running->mCancelled = true;
+      }
+    };
+
+    // Returns the next requested frame, or nullptr if it could not be captured in time.
+    auto getFrame = [this, &results]() {
+      std::shared_ptr<std::vector<std::byte> const> frame;
+      if (results.front().wait_for(getRequestTimeout()) == std::future_status::ready) {
+        try {
+          frame = results.front().get();
+        } catch (std::future_error const&) {}
+      }
+      results.pop_front();
+      return frame && !frame->empty() ? frame : nullptr;
+    };
+
+    // The response is only started once the first frame is available. This way, we can still
+    // report an error if the sequence could not be started at all.
+    auto frame = getFrame();
+    if (!frame) {
+      cancel();
+      mg_send_http_error(conn, 503, "%s", "Failed to capture the first frame.");
+      return;
     }
-  }
 
-  // Execute any pending /save request.
-  {
-    std::lock_guard<std::mutex> lock(mSaveMutex);
-    if (mSaveRequested) {
-      logger().debug("Executing '/save' request.");
-      try {
-        mSaveSettings = mAllSettings->saveToJson();
-      } catch (std::exception const& e) {
-        logger().error("Failed to write settings: {}", e.what());
-        mSaveSettings = "";
+    std::string header = "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: application/x-tar\r\n"
+                         "Content-Disposition: attachment; filename=\"sequence.tar\"\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n\r\n";
+    sendData(conn, header.data(), header.length());
+
+    std::array<char, TAR_BLOCK_SIZE> padding{};
+    int32_t                          sent = 0;
+
+    while (frame) {
+      std::array<char, 32> name{};
+      std::snprintf(name.data(), name.size(), "frame-%05d.%s", sent, extension);
+
+      auto   tarHeader = createTarHeader(name.data(), frame->size());
+      size_t remainder = frame->size() % TAR_BLOCK_SIZE;
+
+      if (sendData(conn, tarHeader.data(), tarHeader.size()) <= 0 ||
+          sendData(conn, frame->data(), frame->size()) <= 0 ||
+          (remainder > 0 && sendData(conn, padding.data(), TAR_BLOCK_SIZE - remainder) <= 0)) {
+        break;
+      }
+
+      ++sent;
+
+      // Like the initial frames, the job is only owned by the main thread once it is queued.
+      if (requested < frameCount) {
+        mTasks->post([weakSequence, job = requestFrame()]() {
+          if (auto running = weakSequence.lock()) {
+            running->mFrames.push_back(job);
+          }
+        });
+        ++requested;
+      }
+
+      frame = sent < frameCount ? getFrame() : nullptr;
+    }
+
+    // The archive is terminated by two empty blocks. If the sequence has not been completed, the
+    // main thread stops rendering further frames.
+    if (sent == frameCount) {
+      sendData(conn, padding.data(), padding.size());
+      sendData(conn, padding.data(), padding.size());
+    } else {
+      logger().warn("Capture sequence aborted after {} of {} frames.", sent, frameCount);
+    }
+
+    cancel();
+  }));
+
+  // The /stream endpoint keeps the connection open and continuously sends the current view as a
+  // multipart response. Each part replaces the previous one, so browsers can display this like a
+  // video. All viewers share the same frames, if a viewer cannot keep up, it will skip frames.
+  mHandlers.emplace("/stream", std::make_unique<GetHandler>([this](mg_connection* conn) {
+    bool   png    = getParam<std::string>(conn, "format", "jpeg") == "png";
+    double fps    = std::clamp(getParam<double>(conn, "fps", 10.0), 0.1, 60.0);
+    auto&  stream = png ? *mPngStream : *mJpegStream;
+
+    std::string header = "HTTP/1.1 200 OK\r\n"
+                         "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+                         "Cache-Control: no-cache\r\n"
+                         "Connection: close\r\n\r\n";
+    sendData(conn, header.data(), header.length());
+
+    auto interval = std::chrono::duration_cast<FrameStream::Clock::duration>(
+        std::chrono::duration<double>(1.0 / fps));
+
+    int32_t  viewer        = stream.addViewer(fps);
+    auto     nextFrameTime = FrameStream::Clock::now();
+    uint64_t lastFrame     = 0;
+
+    // Send frames until the client disconnects or the server is shut down.
+    while (!stream.isClosed()) {
+      auto frame = stream.waitForFrame(lastFrame, std::chrono::milliseconds(1000));
+
+      if (!frame) {
+        continue;
       }
-      mSaveDone.notify_one();
-      mSaveRequested = false;
+
+      std::string partHeader = "--frame\r\nContent-Type: ";
+      partHeader += png ? "image/png" : "image/jpeg";
+      partHeader += "\r\nContent-Length: " + std::to_string(frame->mData->size()) + "\r\n\r\n";
+
+      if (sendData(conn, partHeader.data(), partHeader.length()) <= 0 ||
+          sendData(conn, frame->mData->data(), frame->mData->size()) <= 0 ||
+          sendData(conn, "\r\n", 2) <= 0) {
+        break;
+      }
+
+      lastFrame = frame->mNumber;
+
+      // Wait until the next frame is due. If we are late, we do not try to catch up.
+      nextFrameTime = std::max(nextFrameTime + interval, FrameStream::Clock::now());
+      stream.sleepUntil(nextFrameTime);
     }
-  }
 
-  // Execute any pending /load request.
-  {
-    std::lock_guard<std::mutex> lock(mLoadMutex);
-    if (!mLoadSettings.empty()) {
-      logger().debug("Executing '/load' request.");
-      try {
-        mAllSettings->loadFromJson(mLoadSettings);
-      } catch (std::exception const& e) {
-        logger().error("Failed to read settings: {}", e.what());
-        mSaveSettings = "";
+    stream.removeViewer(viewer);
+  }));
+
+  // All POST requests received on /run-js are stored in a queue. They are executed in the main
+  // thread in the Plugin::update() method further below. If the request has the content type
+  // application/json, the body is expected to be a JSON array of code snippets. Each snippet gets
+  // an ID which can be used to retrieve its result from the /run-js-result endpoint.
+  mHandlers.emplace("/run-js", std::make_unique<PostHandler>([this](mg_connection* conn) {
+    std::string body;
+    if (!readBody(conn, mLimits.mMaxRequestSize, body)) {
+      return;
+    }
+
+    std::vector<std::string> snippets;
+
+    char const* contentType = mg_get_header(conn, "Content-Type");
+    if (contentType && std::string(contentType).find("application/json") == 0) {
+      auto json = nlohmann::json::parse(body, nullptr, false);
+      if (!json.is_array() ||
+          !std::all_of(json.begin(), json.end(), [](auto const& s) { return s.is_string(); })) {
+        mg_send_http_error(conn, 400, "%s", "Expected a JSON array of strings.");
+        return;
       }
-      mLoadSettings.clear();
+      snippets = json.get<std::vector<std::string>>();
+    } else {
+      snippets.push_back(std::move(body));
     }
-  }
 
-  // If a screen shot has been requested, we first resize the image to the given size. Then we wait
-  // mCaptureDelay frames until we actually read the pixels.
-  {
+    nlohmann::json ids = nlohmann::json::array();
 
-    std::lock_guard<std::mutex> lock(mCaptureMutex);
-    if (mCaptureRequested) {
-      auto* window = GetVistaSystem()->GetDisplayManager()->GetWindows().begin()->second;
-      window->GetWindowProperties()->SetSize(mCaptureWidth, mCaptureHeight);
-      mCaptureAtFrame = GetVistaSystem()->GetFrameLoop()->GetFrameCount() + mCaptureDelay;
-      mAllSettings->pEnableUserInterface = mCaptureGui;
-      mCaptureRequested                  = false;
-    }
-
-    // Now we waited several frames. We read the pixels, encode the data as png and notify the
-    // server's worker thread that the screen shot is done.
-    if (mCaptureAtFrame > 0 &&
-        mCaptureAtFrame == GetVistaSystem()->GetFrameLoop()->GetFrameCount()) {
-      logger().debug("Capturing capture for /capture request: resolution = {}x{}, show gui = {}",
-          mCaptureWidth, mCaptureHeight, mCaptureGui);
-
-      auto* window = GetVistaSystem()->GetDisplayManager()->GetWindows().begin()->second;
-      window->GetWindowProperties()->GetSize(mCaptureWidth, mCaptureHeight);
-
-      if (mCaptureDepth) {
-
-        // capture the depth component.
-        std::vector<float> capture(mCaptureWidth * mCaptureHeight);
-        glReadPixels(
-            0, 0, mCaptureWidth, mCaptureHeight, GL_DEPTH_COMPONENT, GL_FLOAT, &capture[0]);
-
-        // We retrieve the current scene scale and far-clip distance in order to scale the depth
-        // values to meters.
-        double      nearClip{};
-        double      farClip{};
-        auto const& p = *GetVistaSystem()->GetDisplayManager()->GetProjectionsConstRef().begin();
-        p.second->GetProjectionProperties()->GetClippingRange(nearClip, farClip);
-
-        float scale = static_cast<float>(farClip * mSolarSystem->getObserver().getAnchorScale());
-        for (auto& f : capture) {
-          f *= scale;
-        }
+    auto count = static_cast<uint32_t>(snippets.size());
+    if (!tryReserve(mPending.mJavaScript, count, mLimits.mMaxPendingJavaScript)) {
+      sendRetryLater(conn, 429, "Too many pending JavaScript calls.");
+      return;
+    }
 
-        // Now write the tiff image.
-        std::ostringstream oStream;
-        TIFF*              out = TIFFStreamOpen("MemTIFF", &oStream);
-
-        TIFFSetField(out, TIFFTAG_IMAGEWIDTH, mCaptureWidth);
-        TIFFSetField(out, TIFFTAG_IMAGELENGTH, mCaptureHeight);
-        TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, 1);
-        TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 32);
-        TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, 16);
-        TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-        TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-        TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
-        TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
-
-        for (int32_t i(0); i < mCaptureHeight; ++i) {
-          TIFFWriteScanline(out, &capture.at((mCaptureHeight - i - 1) * mCaptureWidth), i);
-        }
+    // The code of consecutive calls is collected by the main thread and executed at once. The
+    // cached /save response is invalidated right away, as the code is only executed later.
+    mPending.mModifications += count;
+    {
+      std::lock_guard<std::mutex> lock(mJavaScriptCallsMutex);
+      for (auto& snippet : snippets) {
+        uint64_t id = addJavaScriptCall();
+        ids.push_back(id);
+
+        mTasks->post([this, id, code = std::move(snippet)]() {
+          logger().debug("Executing '/run-js' request {}: '{}'", id, code);
+          --mPending.mJavaScript;
+          ++mJavaScriptCallsInFrame;
+          mJavaScript += wrapJavaScript(id, code);
+          invalidateSaveCache();
+          --mPending.mModifications;
+        });
+      }
+    }
+
+    std::string response = nlohmann::json{{"ids", ids}}.dump();
+    mg_send_http_ok(conn, "application/json", response.length());
+    sendData(conn, response.data(), response.length());
+  }));
 
-        TIFFClose(out);
+  // Returns the result of a /run-js call. If the "wait" parameter is given, the request blocks for
+  // up to the given number of milliseconds until the call has been executed.
+  mHandlers.emplace("/run-js-result", std::make_unique<GetHandler>([this](mg_connection* conn) {
+    auto id   = getParam<uint64_t>(conn, "id", 0);
+    auto wait = std::chrono::milliseconds(std::clamp(getParam<int32_t>(conn, "wait", 0), 0, 5000));
 
-        // Convert the stringstream to a std::vector<std::byte>.
-        std::string s = oStream.str();
-        mCapture.clear();
-        mCapture.reserve(s.size());
+    nlohmann::json json{{"id", id}};
 
-        std::transform(s.begin(), s.end(), std::back_inserter(mCapture),
-            [](char& c) { return static_cast<std::byte>(c); });
+    {
+      std::unique_lock<std::mutex> lock(mJavaScriptCallsMutex);
+      mJavaScriptResultsChanged.wait_for(lock, wait, [this, id]() {
+        auto it = mJavaScriptResults.find(id);
+        return it == mJavaScriptResults.end() || it->second.mDone;
+      });
 
+      auto it = mJavaScriptResults.find(id);
+      if (it == mJavaScriptResults.end()) {
+        json["status"] = "unknown";
+      } else if (!it->second.mDone) {
+        json["status"] = "pending";
+      } else if (!it->second.mError.empty()) {
+        json["status"] = "error";
+        json["error"]  = it->second.mError;
       } else {
-        // Writing pngs is simpler.
-        std::vector<std::byte> capture(mCaptureWidth * mCaptureHeight * 3);
-        glReadPixels(0, 0, mCaptureWidth, mCaptureHeight, GL_RGB, GL_UNSIGNED_BYTE, &capture[0]);
-
-        // We encode the png data in the main thread as this is not thread-safe.
-        stbi_flip_vertically_on_write(1);
-        stbi_write_png_to_func(&pngWriteToVector, &mCapture, mCaptureWidth, mCaptureHeight, 3,
-            capture.data(), mCaptureWidth * 3);
-        stbi_flip_vertically_on_write(0);
+        auto result    = nlohmann::json::parse(it->second.mResult, nullptr, false);
+        json["status"] = "done";
+        json["result"] = result.is_discarded() ? nullptr : result;
       }
-
-      mCaptureAtFrame = 0;
-      mCaptureDone.notify_one();
     }
-  }
 
-  // In this plugin, we cannot call this directly when the onLoad signal of the settings is fired,
-  // since reloading can cause our server to be restarted. And as reloading can be triggered from a
-  // /load request, this could lead to a deadlock.
-  if (mReloadRequired) {
-    from_json(mAllSettings->mPlugins.at("csp-web-api"), mPluginSettings);
-  }
-}
+    std::string response = json.dump();
+    mg_send_http_ok(conn, "application/json", response.length());
+    sendData(conn, response.data(), response.length());
+  }));
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+  // A /batch request contains a JSON array of operations. They are executed in the main thread in
+  // the Plugin::update() method further below. Once all operations are done, the results are sent
+  // back as a JSON array. Captured images are embedded as base64 strings.
+  mHandlers.emplace("/batch", std::make_unique<PostHandler>([this](mg_connection* conn) {
+    std::string body;
+    if (!readBody(conn, mLimits.mMaxRequestSize, body)) {
+      return;
+    }
 
-void Plugin::startServer(uint16_t port) {
+    auto batch         = std::make_shared<BatchJob>();
+    batch->mOperations = nlohmann::json::parse(body, nullptr, false);
 
-  // First quit the server as it may be running already.
-  quitServer();
+    if (!batch->mOperations.is_array()) {
+      mg_send_http_error(conn, 400, "%s", "Expected a JSON array of operations.");
+      return;
+    }
 
-  try {
-    // We start the server with one thread only, as we do not want to process requests in parallel.
-    std::vector<std::string> options{"listening_ports", std::to_string(port), "num_threads", "1"};
-    mServer = std::make_unique<CivetServer>(options);
+    auto done = batch->mDone.get_future();
 
-    for (auto const& handler : mHandlers) {
-      mServer->addHandler(handler.first, *handler.second);
+    if (!tryReserve(mPending.mBatches, 1, mLimits.mMaxPendingBatches)) {
+      sendRetryLater(conn, 429, "Too many pending batches.");
+      return;
     }
 
-  } catch (std::exception const& e) { logger().warn("Failed to start server: {}!", e.what()); }
-}
+    // The batch is not kept by this thread. This way, the promise is broken as soon as the main
+    // thread drops the batch, for example when the plugin is unloaded.
+    ++mPending.mModifications;
+    mTasks->post([this, batch = std::move(batch)]() { mBatches.push_back(batch); });
 
-////////////////////////////////////////////////////////////////////////////////////////////////////
+    // If the batch takes too long, the remaining operations are still executed, but the results
+    // are discarded.
+    if (done.wait_for(getRequestTimeout()) == std::future_status::timeout) {
+      sendRetryLater(conn, 503, "Timeout while waiting for the batch.");
+      return;
+    }
+
+    BatchResult batchResult;
+
+    try {
+      batchResult = done.get();
+    } catch (std::future_error const&) {
+      mg_send_http_error(conn, 503, "%s", "The batch has been cancelled.");
+      return;
+    }
+
+    nlohmann::json json = nlohmann::json::array();
+
+    for (size_t i(0); i < batchResult.mResults.size(); ++i) {
+      auto& result = batchResult.mResults[i];
+
+      if (batchResult.mSettings.count(i) != 0) {
+        result["settings"] = nlohmann::json::parse(batchResult.mSettings[i], nullptr, false);
+      }
+
+      if (batchResult.mCaptures.count(i) != 0) {
+        auto const& capture = batchResult.mCaptures[i];
+        if (capture && !capture->empty()) {
+          result["data"] = toBase64(*capture);
+        } else {
+          result["status"] = "error";
+          result["error"]  = "Failed to capture the image.";
+        }
+      }
+
+      json.push_back(std::move(result));
+    }
+
+    std::string response = json.dump();
+    mg_send_http_ok(conn, "application/json", response.length());
+    sendData(conn, response.data(), response.length());
+  }));
+
+  // Return the observer and time state of the last frame. This never waits for the main thread, so
+  // it can be queried at a high rate. With "format=binary", a compact binary representation is
+  // returned instead of JSON. See StateSnapshot::toBinary() for the layout.
+  mHandlers.emplace("/state", std::make_unique<GetHandler>([this](mg_connection* conn) {
+    StateSnapshot::Data data;
+    if (!mStateSnapshot->read(data)) {
+      sendRetryLater(conn, 503, "No frame has been rendered yet.");
+      return;
+    }
+
+    std::string response;
+    std::string contentType;
+
+    if (getParam<std::string>(conn, "format", "json") == "binary") {
+      response    = StateSnapshot::toBinary(data);
+      contentType = "application/octet-stream";
+    } else {
+      response    = nlohmann::json(data).dump();
+      contentType = "application/json";
+    }
+
+    mg_send_http_ok(conn, contentType.c_str(), response.length());
+    sendData(conn, response.data(), response.length());
+  }));
+
+  // Return the statistics of this plugin in the Prometheus text format.
+  mHandlers.emplace("/metrics", std::make_unique<GetHandler>([this](mg_connection* conn) {
+    std::ostringstream out;
+    mMetrics->write(out);
+
+    // The queue lengths are not recorded continuously, we only retrieve them when requested.
+    size_t javaScript = mPending.mJavaScript;
+    size_t patches    = mPending.mPatches;
+    size_t batches    = mPending.mBatches;
+    size_t captures   = mPending.mCaptures;
+
+    out << "# HELP csp_web_api_queue_length Number of requests waiting for the main thread.\n";
+    out << "# TYPE csp_web_api_queue_length gauge\n";
+    out << "csp_web_api_queue_length{queue=\"run-js\"} " << javaScript << "\n";
+    out << "csp_web_api_queue_length{queue=\"patch\"} " << patches << "\n";
+    out << "csp_web_api_queue_length{queue=\"capture\"} " << captures << "\n";
+    out << "csp_web_api_queue_length{queue=\"batch\"} " << batches << "\n";
+
+    std::string response = out.str();
+    mg_send_http_ok(conn, "text/plain; version=0.0.4", response.length());
+    sendData(conn, response.data(), response.length());
+  }));
+
+  // Record the statistics of all endpoints. All handlers are derived from LambdaHandler.
+  for (auto const& handler : mHandlers) {
+    static_cast<LambdaHandler*>(handler.second.get())
+        ->setMetrics(&mMetrics->addEndpoint(handler.first));
+  }
+
+  // The wrapped /run-js code reports its result with this callback.
+  mGuiManager->getGui()->registerCallback("webapi.reportResult",
+      "Reports the result of a JavaScript snippet executed via the /run-js endpoint.",
+      std::function([this](double id, std::string&& result, std::string&& error) {
+        std::lock_guard<std::mutex> lock(mJavaScriptCallsMutex);
+        auto it = mJavaScriptResults.find(static_cast<uint64_t>(id));
+        if (it != mJavaScriptResults.end()) {
+          it->second = {true, std::move(result), std::move(error)};
+          mJavaScriptResultsChanged.notify_all();
+        }
+      }));
+
+  mOnLoadConnection = mAllSettings->onLoad().connect([this]() {
+    mReloadRequired = true;
+    invalidateSaveCache();
+    mEventChannel->publish(EventChannel::Topic::eSettings, {{"event", "load"}});
+  });
+
+  mOnSaveConnection = mAllSettings->onSave().connect([this]() {
+    mAllSettings->mPlugins["csp-web-api"] = mPluginSettings;
+    mEventChannel->publish(EventChannel::Topic::eSettings, {{"event", "save"}});
+  });
+
+  // Changes of these properties are part of the saved settings, so they invalidate the cached
+  // /save response right away. The observer is not a property, it is compared in update().
+  mOnGuiConnection = mAllSettings->pEnableUserInterface.connect(
+      [this](bool /*enabled*/) { invalidateSaveCache(); });
+  mOnTimeConnection = mTimeControl->pSimulationTime.connect(
+      [this](double /*time*/) { invalidateSaveCache(); });
+  mOnTimeSpeedConnection =
+      mTimeControl->pTimeSpeed.connect([this](float /*speed*/) { invalidateSaveCache(); });
+
+  logger().info("Loading done.");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::deInit() {
+  logger().info("Unloading plugin...");
+
+  mAllSettings->onLoad().disconnect(mOnLoadConnection);
+  mAllSettings->onSave().disconnect(mOnSaveConnection);
+  mAllSettings->pEnableUserInterface.disconnect(mOnGuiConnection);
+  mTimeControl->pSimulationTime.disconnect(mOnTimeConnection);
+  mTimeControl->pTimeSpeed.disconnect(mOnTimeSpeedConnection);
+  cs::utils::onLogMessage().disconnect(mOnLogMessageConnection);
+  mGuiManager->getGui()->unregisterCallback("webapi.reportResult");
+
+  // Drop all pending tasks and batches. This will make the waiting /batch requests return.
+  mTasks->clear();
+  mBatches.clear();
+
+  {
+    std::lock_guard<std::mutex> lock(mLoadMutex);
+    mLoadSettings.reset();
+  }
+
+  // Drop all pending captures. This will make the waiting /capture requests return. A running
+  // offscreen capture has to restore the projection and the user interface first.
+  mCaptureJobs.clear();
+  abortActiveCapture();
+
+  if (mSequence) {
+    mSequence->mFrames.clear();
+    mSequence.reset();
+  }
+  mSequenceRunning = false;
+
+  // A restart of the server which is still in progress can finish now, as all requests waiting
+  // for the main thread return.
+  if (mServerThread.joinable()) {
+    mServerThread.join();
+  }
+
+  // The encoder threads read directly from the mapped pixel-pack buffers, so they have to finish
+  // before the buffers are deleted.
+  mEncoderPool.reset();
+  mPixelReadback.reset();
+  mDownsampler.reset();
+
+  quitServer();
+
+  mEventChannel.reset();
+
+  logger().info("Unloading done.");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::update() {
+  Metrics::ScopedTimer updateTimer(mMetrics->getSection(Metrics::Section::eUpdate));
+
+  // Execute the tasks posted by the server threads since the last call to update() in the order
+  // they were received. Consecutive /run-js requests are combined into a single
+  // executeJavascript() call. If the tasks take too long or too many /run-js calls have been
+  // collected, the remaining ones are executed in the next frame. If nothing is pending, this is a
+  // single atomic load.
+  {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eTasks));
+    if (!mTasks->empty()) {
+      mJavaScriptCallsInFrame = 0;
+      mTasks->process(TASK_FRAME_BUDGET,
+          [this]() { return mJavaScriptCallsInFrame >= MAX_JAVASCRIPT_CALLS_PER_FRAME; });
+      executePendingJavaScript();
+    }
+  }
+
+  // The cached /save response is dropped if the observer or the simulation time changed or if it
+  // is older than the configured maximum age. By default, this is zero, so the cache is only used
+  // within the frame in which it was created. Changes of settings which are neither applied by
+  // this plugin nor covered by the connected properties are not noticed otherwise.
+  if (mSaveCacheValid) {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eSave));
+    auto maxAge = std::chrono::duration<double>(
+        mPluginSettings.mSaveCacheMaxAge.value_or(DEFAULT_SAVE_CACHE_MAX_AGE));
+
+    if (!(getObservedState() == mSaveCacheState) ||
+        std::chrono::steady_clock::now() - mSaveCacheTime > maxAge) {
+      mSaveCacheValid = false;
+    }
+  }
+
+  // Execute the pending /batch requests. They are executed one after another, so a batch which
+  // waits for a capture delays all following batches.
+  {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eBatch));
+    while (!mBatches.empty() && updateBatch(*mBatches.front())) {
+      mBatches.front()->mDone.set_value(std::move(mBatches.front()->mResult));
+      mBatches.pop_front();
+      --mPending.mBatches;
+      --mPending.mModifications;
+    }
+  }
+
+  // Process the pending /capture requests. They are processed one after another, but all requests
+  // with equal settings are served by the same capture. As soon as the pixels of a capture have
+  // been read, the next capture can start while the previous one is still being encoded.
+  {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eCapture));
+
+    // This checks whether a previously issued read has been completed by the GPU. If so, the
+    // corresponding callback will be executed.
+    mPixelReadback->update();
+
+    // If all requests of the running capture timed out or its sequence has been cancelled, there
+    // is no point in finishing it. This matters for tiled offscreen captures, which take several
+    // frames.
+    if (mActiveCapture) {
+      auto const& jobs      = mActiveCapture->mJobs;
+      bool        cancelled = false;
+
+      if (mActiveCapture->mExclusive) {
+        cancelled = !mSequence || mSequence->mCancelled;
+      } else {
+        cancelled = !jobs.empty() && std::all_of(jobs.begin(), jobs.end(),
+                                         [](auto const& job) { return job->mCancelled.load(); });
+      }
+
+      if (cancelled) {
+        abortActiveCapture();
+      }
+    }
+
+    // A running /capture-sequence takes precedence over all other captures.
+    if (!mActiveCapture && mSequence) {
+      updateSequence();
+    }
+
+    // Jobs whose requests timed out before their capture started are not captured at all.
+    while (!mCaptureJobs.empty() && mCaptureJobs.front()->mCancelled) {
+      mCaptureJobs.pop_front();
+    }
+
+    if (!mActiveCapture && !mSequence && !mCaptureJobs.empty()) {
+      mActiveCapture            = std::make_unique<ActiveCapture>();
+      mActiveCapture->mSettings = mCaptureJobs.front()->mSettings;
+
+      if (mActiveCapture->mSettings.mOffscreen) {
+        // If all pixel-pack buffers are currently in use, we will try again in the next frame.
+        if (!beginOffscreenCapture()) {
+          mActiveCapture.reset();
+        }
+      } else {
+        beginWindowCapture();
+      }
+    }
+
+    if (mActiveCapture) {
+      if (!mActiveCapture->mExclusive) {
+        collectCaptureJobs();
+      }
+
+      if (mActiveCapture->mOffscreen) {
+        updateOffscreenCapture();
+      } else {
+        updateWindowCapture();
+      }
+    }
+  }
+
+  // Capture a new frame for the /stream endpoint if any viewer is waiting for one.
+  {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eStream));
+    updateStreams();
+  }
+
+  // Publish the observer and time state of this frame for the /state endpoint.
+  {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eState));
+    updateStateSnapshot();
+  }
+
+  // In this plugin, we cannot call this directly when the onLoad signal of the settings is fired,
+  // since reloading can cause our server to be restarted. And as reloading can be triggered from a
+  // /load request, this could lead to a deadlock.
+  if (mReloadRequired) {
+    mReloadRequired = false;
+    from_json(mAllSettings->mPlugins.at("csp-web-api"), mPluginSettings);
+    updateRequestLimits();
+
+    // This also allows to pick up changes of the served files without restarting.
+    mStaticFiles->setSources(mPluginSettings.mPage, mPluginSettings.mStaticDirectory);
+
+    // The server is started in the first frame and restarted whenever its options change.
+    if (getServerOptions(mPluginSettings.mPort.get()) != mServerOptions) {
+      mServerRestartRequired = true;
+    }
+  }
+
+  // Stopping the server waits for all running requests, and some of them may wait for the main
+  // thread. Hence, the server is restarted on a separate thread while the main thread keeps
+  // processing the requests. Changes made in the meantime are applied once the restart is done.
+  if (mServerRestartRequired && !mServerRestarting) {
+    mServerRestartRequired = false;
+
+    if (mServerThread.joinable()) {
+      mServerThread.join();
+    }
+
+    mServerOptions    = getServerOptions(mPluginSettings.mPort.get());
+    mServerRestarting = true;
+    mServerThread     = std::thread([this, options = mServerOptions]() {
+      startServer(options);
+      mServerRestarting = false;
+    });
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Plugin::CaptureSettings::operator==(CaptureSettings const& other) const {
+  return mWidth == other.mWidth && mHeight == other.mHeight && mDelay == other.mDelay &&
+         mGui == other.mGui && mDepth == other.mDepth && mOffscreen == other.mOffscreen &&
+         mFormat == other.mFormat && mQuality == other.mQuality &&
+         mCompression == other.mCompression && mDepthFormat == other.mDepthFormat &&
+         mDepthCompression == other.mDepthCompression && mDepthMax == other.mDepthMax &&
+         mCropX == other.mCropX && mCropY == other.mCropY && mCropWidth == other.mCropWidth &&
+         mCropHeight == other.mCropHeight && mScale == other.mScale;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::array<int32_t, 4> Plugin::CaptureSettings::getRegion(
+    int32_t imageWidth, int32_t imageHeight) const {
+  int32_t x      = std::clamp(mCropX, 0, imageWidth - 1);
+  int32_t y      = std::clamp(mCropY, 0, imageHeight - 1);
+  int32_t width  = mCropWidth > 0 ? std::min(mCropWidth, imageWidth - x) : imageWidth - x;
+  int32_t height = mCropHeight > 0 ? std::min(mCropHeight, imageHeight - y) : imageHeight - y;
+
+  return {x, imageHeight - y - height, width, height};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int32_t Plugin::CaptureSettings::getScaledSize(int32_t size) const {
+  return std::max(1, static_cast<int32_t>(std::lround(static_cast<float>(size) * mScale)));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+char const* Plugin::CaptureSettings::getContentType() const {
+  return mDepth ? "image/tiff" : csp::webapi::getContentType(mFormat);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+char const* Plugin::CaptureSettings::getFileExtension() const {
+  if (mDepth) {
+    return "tiff";
+  }
+
+  switch (mFormat) {
+  case ImageFormat::eJPEG:
+    return "jpg";
+  case ImageFormat::eQOI:
+    return "qoi";
+  case ImageFormat::eRaw:
+    return "raw";
+  default:
+    return "png";
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::collectCaptureJobs() {
+  auto it = mCaptureJobs.begin();
+  while (it != mCaptureJobs.end()) {
+    if ((*it)->mSettings == mActiveCapture->mSettings) {
+      mActiveCapture->mJobs.push_back(std::move(*it));
+      it = mCaptureJobs.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::updateSequence() {
+  auto& sequence   = *mSequence;
+  auto  frameCount = sequence.mFrameCount;
+
+  // Once the last frame has been read or the client is gone, the time continues as before.
+  if (sequence.mCancelled || sequence.mNext >= frameCount) {
+    if (sequence.mNext > 0) {
+      mTimeControl->pTimeSpeed = sequence.mOriginalTimeSpeed;
+    }
+    mSequence.reset();
+    mSequenceRunning = false;
+    return;
+  }
+
+  // The next frame is requested once the client has received enough of the previous ones.
+  if (sequence.mFrames.empty()) {
+    return;
+  }
+
+  // The time is paused during the sequence, so that each frame shows exactly the requested time
+  // regardless of the frame rate.
+  if (sequence.mNext == 0) {
+    sequence.mStartTime         = mTimeControl->pSimulationTime.get();
+    sequence.mOriginalTimeSpeed = mTimeControl->pTimeSpeed.get();
+    mTimeControl->pTimeSpeed    = 0.F;
+  }
+
+  mTimeControl->pSimulationTime = sequence.mStartTime + sequence.mNext * sequence.mTimeStep;
+
+  // The keyframes of the observer path are distributed evenly over the frames. In between, the
+  // position is interpolated linearly and the rotation spherically.
+  if (!sequence.mPath.empty()) {
+    auto const& path = sequence.mPath;
+    double      t    = frameCount > 1 ? 1.0 * sequence.mNext / (frameCount - 1) : 0.0;
+    double      p    = t * static_cast<double>(path.size() - 1);
+    size_t      i    = std::min(static_cast<size_t>(p), path.size() - 1);
+    size_t      j    = std::min(i + 1, path.size() - 1);
+    double      a    = p - static_cast<double>(i);
+
+    auto& observer = mSolarSystem->getObserver();
+    if (!path[i].mCenterName.empty()) {
+      observer.setCenterName(path[i].mCenterName);
+    }
+    if (!path[i].mFrameName.empty()) {
+      observer.setFrameName(path[i].mFrameName);
+    }
+    observer.setAnchorPosition(glm::mix(path[i].mPosition, path[j].mPosition, a));
+    observer.setAnchorRotation(glm::slerp(path[i].mRotation, path[j].mRotation, a));
+  }
+
+  // Only the first frame has to wait for the window to be resized. For the following frames, a
+  // few frames are enough for the scene to settle.
+  mActiveCapture             = std::make_unique<ActiveCapture>();
+  mActiveCapture->mSettings  = sequence.mSettings;
+  mActiveCapture->mExclusive = true;
+  mActiveCapture->mJobs.push_back(sequence.mFrames.front());
+
+  if (sequence.mNext > 0) {
+    mActiveCapture->mSettings.mDelay = sequence.mSettleFrames;
+  }
+
+  if (mActiveCapture->mSettings.mOffscreen) {
+    // If all pixel-pack buffers are currently in use, we will try again in the next frame.
+    if (!beginOffscreenCapture()) {
+      mActiveCapture.reset();
+      return;
+    }
+  } else {
+    beginWindowCapture();
+  }
+
+  sequence.mFrames.pop_front();
+  ++sequence.mNext;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+PixelReadback::Callback Plugin::encodeCapture(int32_t width, int32_t height) {
+
+  // The jobs are moved to the callback, so that the next capture can be started right away.
+  auto jobs = std::make_shared<std::vector<std::shared_ptr<CaptureJob>>>(
+      std::move(mActiveCapture->mJobs));
+
+  // This is called on an encoder thread once the image has been encoded.
+  auto fulfill = [this, jobs, settings = mActiveCapture->mSettings](
+                     std::vector<std::byte>&& capture) {
+    auto result = std::make_shared<std::vector<std::byte> const>(std::move(capture));
+    for (auto& job : *jobs) {
+      job->mResult.set_value(result);
+    }
+
+    if (mEventChannel->hasSubscribers(EventChannel::Topic::eCapture)) {
+      mEventChannel->publish(EventChannel::Topic::eCapture,
+          {{"width", settings.mWidth}, {"height", settings.mHeight}, {"depth", settings.mDepth},
+              {"offscreen", settings.mOffscreen}, {"contentType", settings.getContentType()},
+              {"size", result->size()},
+              {"success", !result->empty()}, {"requests", jobs->size()}});
+    }
+  };
+
+  // Color images are simple, we just have to hand the pixels over to the encoder threads. Large
+  // captures are encoded in parallel strips, as encoding usually takes longer than capturing.
+  if (!mActiveCapture->mSettings.mDepth) {
+    auto settings    = mActiveCapture->mSettings;
+    auto threadCount = std::max(1U, std::thread::hardware_concurrency());
+
+    return [this, width, height, settings, threadCount, fulfill](
+               std::shared_ptr<PixelReadback::Pixels const> pixels) {
+      auto encode = [this, width, height, settings, threadCount, fulfill,
+                        pixels = std::move(pixels)]() mutable {
+        std::vector<std::byte> capture;
+        if (!pixels->empty()) {
+          Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eEncode));
+          switch (settings.mFormat) {
+          case ImageFormat::eJPEG:
+            capture = encodeJPEG(pixels->data(), width, height, settings.mQuality);
+            break;
+          case ImageFormat::eQOI:
+            capture = encodeQOI(pixels->data(), width, height, threadCount);
+            break;
+          case ImageFormat::eRaw:
+            capture = encodeRaw(pixels->data(), width, height, threadCount);
+            break;
+          default:
+            capture = encodePNG(pixels->data(), width, height, settings.mCompression, threadCount);
+            break;
+          }
+        }
+
+        // The pixel-pack buffer can be reused once the pixels have been encoded.
+        pixels.reset();
+        fulfill(std::move(capture));
+      };
+
+      mEncoderPool->enqueue(std::move(encode));
+    };
+  }
+
+  // For depth images, we retrieve the current scene scale and far-clip distance in order to scale
+  // the depth values to meters. This has to be done now, as they may have changed once the pixels
+  // are actually available.
+  double      nearClip{};
+  double      farClip{};
+  auto const& p = *GetVistaSystem()->GetDisplayManager()->GetProjectionsConstRef().begin();
+  p.second->GetProjectionProperties()->GetClippingRange(nearClip, farClip);
+
+  float scale = static_cast<float>(farClip * mSolarSystem->getObserver().getAnchorScale());
+
+  auto settings = mActiveCapture->mSettings;
+  auto maxDepth  = settings.mDepthMax > 0.F ? settings.mDepthMax : scale;
+
+  return [this, width, height, scale, maxDepth, settings, fulfill](
+             std::shared_ptr<PixelReadback::Pixels const> pixels) {
+    auto encode = [this, width, height, scale, maxDepth, settings, fulfill,
+                      pixels = std::move(pixels)]() mutable {
+      std::vector<std::byte> capture;
+      if (!pixels->empty()) {
+        Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eEncode));
+        capture = encodeDepthTIFF(pixels->data(), width, height, scale, settings.mDepthFormat,
+            settings.mDepthCompression, maxDepth);
+      }
+
+      pixels.reset();
+      fulfill(std::move(capture));
+    };
+
+    mEncoderPool->enqueue(std::move(encode));
+  };
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::updateStreams() {
+  bool jpegDue = mJpegStream->beginFrame();
+  bool pngDue  = mPngStream->beginFrame();
+
+  if (!jpegDue && !pngDue) {
+    return;
+  }
+
+  int32_t width  = 0;
+  int32_t height = 0;
+  auto*   window = GetVistaSystem()->GetDisplayManager()->GetWindows().begin()->second;
+  window->GetWindowProperties()->GetSize(width, height);
+
+  // The pixels are read only once and then encoded for each format which is due.
+  bool issued = mPixelReadback->read(PixelReadback::Format::eRGB, 0, 0, width, height,
+      [this, width, height, jpegDue, pngDue](std::shared_ptr<PixelReadback::Pixels const> pixels) {
+        auto encode = [this, width, height, jpegDue, pngDue, pixels = std::move(pixels)]() mutable {
+          Metrics::ScopedTimer   timer(mMetrics->getSection(Metrics::Section::eEncode));
+          std::vector<std::byte> png;
+          std::vector<std::byte> jpeg;
+
+          if (pngDue && !pixels->empty()) {
+            png = encodePNG(pixels->data(), width, height);
+          }
+
+          if (jpegDue && !pixels->empty()) {
+            jpeg = encodeJPEG(pixels->data(), width, height, STREAM_JPEG_QUALITY);
+          }
+
+          pixels.reset();
+
+          if (pngDue) {
+            mPngStream->publish(std::move(png));
+          }
+
+          if (jpegDue) {
+            mJpegStream->publish(std::move(jpeg));
+          }
+        };
+
+        mEncoderPool->enqueue(std::move(encode));
+      });
+
+  // If all pixel-pack buffers are currently in use, the frames are skipped.
+  if (!issued) {
+    if (jpegDue) {
+      mJpegStream->publish({});
+    }
+    if (pngDue) {
+      mPngStream->publish({});
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::beginWindowCapture() {
+  auto const& settings = mActiveCapture->mSettings;
+
+  // We first resize the window to the given size. Then we wait mDelay frames until we actually
+  // read the pixels.
+  auto* window = GetVistaSystem()->GetDisplayManager()->GetWindows().begin()->second;
+  window->GetWindowProperties()->SetSize(settings.mWidth, settings.mHeight);
+  mActiveCapture->mAtFrame = GetVistaSystem()->GetFrameLoop()->GetFrameCount() + settings.mDelay;
+  mAllSettings->pEnableUserInterface = settings.mGui;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::updateWindowCapture() {
+  if (mActiveCapture->mAtFrame > GetVistaSystem()->GetFrameLoop()->GetFrameCount()) {
+    return;
+  }
+
+  auto const& settings = mActiveCapture->mSettings;
+
+  // Now we waited several frames. We issue an asynchronous read of the pixels. Once they are
+  // available, they are encoded on one of the encoder threads and the server's worker threads are
+  // notified that the screen shot is done.
+  int32_t width  = 0;
+  int32_t height = 0;
+  auto*   window = GetVistaSystem()->GetDisplayManager()->GetWindows().begin()->second;
+  window->GetWindowProperties()->GetSize(width, height);
+
+  auto    region       = settings.getRegion(width, height);
+  int32_t outputWidth  = settings.getScaledSize(region[2]);
+  int32_t outputHeight = settings.getScaledSize(region[3]);
+  bool    scaled       = outputWidth != region[2] || outputHeight != region[3];
+
+  logger().debug("Capturing capture for /capture request: resolution = {}x{}, show gui = {}",
+      outputWidth, outputHeight, settings.mGui);
+
+  auto format = settings.mDepth ? PixelReadback::Format::eDepth : PixelReadback::Format::eRGB;
+
+  // If all pixel-pack buffers are currently in use, we will try again in the next frame.
+  int32_t readback = mPixelReadback->begin(format, outputWidth, outputHeight);
+
+  if (readback < 0) {
+    return;
+  }
+
+  // A scaled capture is first blitted to a framebuffer of the output size, which is then read.
+  // If this fails, the requests receive an empty image.
+  if (scaled) {
+    if (!mDownsampler->begin(settings.mDepth, region[0], region[1], region[2], region[3],
+            outputWidth, outputHeight)) {
+      mPixelReadback->cancel(readback);
+      encodeCapture(outputWidth, outputHeight)({});
+      mActiveCapture.reset();
+      return;
+    }
+
+    region = {0, 0, outputWidth, outputHeight};
+  }
+
+  mPixelReadback->readRegion(readback, region[0], region[1], region[2], region[3], 0, 0);
+  mPixelReadback->finish(readback, encodeCapture(outputWidth, outputHeight));
+  mActiveCapture.reset();
+
+  if (scaled) {
+    mDownsampler->end();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Plugin::beginOffscreenCapture() {
+  auto const& settings = mActiveCapture->mSettings;
+
+  auto format = settings.mDepth ? PixelReadback::Format::eDepth : PixelReadback::Format::eRGB;
+
+  // Cropped and scaled offscreen captures are directly rendered at the output resolution.
+  auto region = settings.getRegion(settings.mWidth, settings.mHeight);
+
+  OffscreenCapture capture;
+  capture.mWidth    = settings.getScaledSize(region[2]);
+  capture.mHeight   = settings.getScaledSize(region[3]);
+  capture.mReadback = mPixelReadback->begin(format, capture.mWidth, capture.mHeight);
+
+  if (capture.mReadback < 0) {
+    return false;
+  }
+
+  logger().debug("Capturing offscreen image for /capture request: resolution = {}x{}",
+      capture.mWidth, capture.mHeight);
+
+  // Each tile is as large as the window.
+  auto* window = GetVistaSystem()->GetDisplayManager()->GetWindows().begin()->second;
+  window->GetWindowProperties()->GetSize(capture.mWindowWidth, capture.mWindowHeight);
+
+  capture.mTilesX = (capture.mWidth + capture.mWindowWidth - 1) / capture.mWindowWidth;
+  capture.mTilesY = (capture.mHeight + capture.mWindowHeight - 1) / capture.mWindowHeight;
+
+  // The uncropped image covers the same vertical extent of the projection plane as the window.
+  // The horizontal extent is chosen according to the aspect ratio of the requested image. The
+  // captured image covers the cropped region of this, with larger pixels if it is scaled.
+  auto* projection =
+      GetVistaSystem()->GetDisplayManager()->GetProjectionsConstRef().begin()->second;
+  auto& extents = capture.mOriginalExtents;
+  projection->GetProjectionProperties()->GetProjPlaneExtents(
+      extents[0], extents[1], extents[2], extents[3]);
+
+  double pixelSize   = (extents[3] - extents[2]) / settings.mHeight;
+  double left        = (extents[0] + extents[1] - pixelSize * settings.mWidth) * 0.5;
+  capture.mPixelSize = pixelSize * region[3] / capture.mHeight;
+  capture.mLeft      = left + pixelSize * region[0];
+  capture.mBottom    = extents[2] + pixelSize * region[1];
+
+  // The user interface is drawn in screen space, so it would be repeated on each tile. Therefore
+  // it is hidden unless explicitly requested.
+  capture.mOriginalGui = mAllSettings->pEnableUserInterface.get();
+  if (!settings.mGui) {
+    mAllSettings->pEnableUserInterface = false;
+  }
+
+  mActiveCapture->mOffscreen = capture;
+  setupOffscreenTile();
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::setupOffscreenTile() {
+  auto& capture = mActiveCapture->mOffscreen.value();
+
+  int32_t tileX = capture.mTile % capture.mTilesX;
+  int32_t tileY = capture.mTile / capture.mTilesX;
+
+  // The projection plane is adjusted so that the current tile fills the entire window.
+  double left   = capture.mLeft + tileX * capture.mWindowWidth * capture.mPixelSize;
+  double bottom = capture.mBottom + tileY * capture.mWindowHeight * capture.mPixelSize;
+  double right  = left + capture.mWindowWidth * capture.mPixelSize;
+  double top    = bottom + capture.mWindowHeight * capture.mPixelSize;
+
+  auto* projection =
+      GetVistaSystem()->GetDisplayManager()->GetProjectionsConstRef().begin()->second;
+  projection->GetProjectionProperties()->SetProjPlaneExtents(left, right, bottom, top);
+
+  mActiveCapture->mAtFrame =
+      GetVistaSystem()->GetFrameLoop()->GetFrameCount() + mActiveCapture->mSettings.mDelay;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::updateOffscreenCapture() {
+  if (mActiveCapture->mAtFrame > GetVistaSystem()->GetFrameLoop()->GetFrameCount()) {
+    return;
+  }
+
+  auto& capture = mActiveCapture->mOffscreen.value();
+
+  // Copy the current tile to its position in the pixel-pack buffer. Tiles at the right and top
+  // border of the image may be smaller than the window.
+  int32_t x      = (capture.mTile % capture.mTilesX) * capture.mWindowWidth;
+  int32_t y      = (capture.mTile / capture.mTilesX) * capture.mWindowHeight;
+  int32_t width  = std::min(capture.mWindowWidth, capture.mWidth - x);
+  int32_t height = std::min(capture.mWindowHeight, capture.mHeight - y);
+
+  mPixelReadback->readRegion(capture.mReadback, 0, 0, width, height, x, y);
+
+  ++capture.mTile;
+
+  if (capture.mTile < capture.mTilesX * capture.mTilesY) {
+    setupOffscreenTile();
+    return;
+  }
+
+  // All tiles have been read, so we can restore the original projection and user interface.
+  endOffscreenCapture();
+
+  mPixelReadback->finish(capture.mReadback, encodeCapture(capture.mWidth, capture.mHeight));
+  mActiveCapture.reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::endOffscreenCapture() {
+  auto const& capture = mActiveCapture->mOffscreen.value();
+  auto const& extents = capture.mOriginalExtents;
+  auto*       projection =
+      GetVistaSystem()->GetDisplayManager()->GetProjectionsConstRef().begin()->second;
+  projection->GetProjectionProperties()->SetProjPlaneExtents(
+      extents[0], extents[1], extents[2], extents[3]);
+
+  mAllSettings->pEnableUserInterface = capture.mOriginalGui;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::abortActiveCapture() {
+  if (!mActiveCapture) {
+    return;
+  }
+
+  if (mActiveCapture->mOffscreen) {
+    endOffscreenCapture();
+    mPixelReadback->cancel(mActiveCapture->mOffscreen->mReadback);
+  }
+
+  // Dropping the capture drops its jobs, so their requests return.
+  mActiveCapture.reset();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Plugin::CaptureSettings Plugin::readCaptureSettings(
+    std::function<std::string(std::string const&, std::string const&)> const& getParam) {
+  CaptureSettings settings;
+
+  // In offscreen mode, the window is not resized, so we can capture images which are much larger
+  // than the screen. Also, we do not have to wait for so many frames.
+  settings.mOffscreen = getParam("mode", "window") == "offscreen";
+
+  int32_t maxSize  = settings.mOffscreen ? MAX_OFFSCREEN_CAPTURE_SIZE : MAX_WINDOW_CAPTURE_SIZE;
+  int32_t minDelay = settings.mOffscreen ? 2 : 1;
+  int32_t delay    = settings.mOffscreen ? 2 : 50;
+
+  auto getInt = [&getParam](std::string const& name, int32_t fallback) {
+    return cs::utils::fromString<int32_t>(getParam(name, std::to_string(fallback)));
+  };
+
+  settings.mDelay  = std::clamp(getInt("delay", delay), minDelay, 200);
+  settings.mWidth  = std::clamp(getInt("width", 800), 10, maxSize);
+  settings.mHeight = std::clamp(getInt("height", 600), 10, maxSize);
+  settings.mGui    = getParam("gui", "false") == "true";
+  settings.mDepth  = getParam("depth", "false") == "true";
+
+  // The format is ignored for depth captures, these are always TIFF images.
+  auto format = getParam("format", "png");
+  if (format == "jpeg" || format == "jpg") {
+    settings.mFormat = ImageFormat::eJPEG;
+  } else if (format == "qoi") {
+    settings.mFormat = ImageFormat::eQOI;
+  } else if (format == "raw") {
+    settings.mFormat = ImageFormat::eRaw;
+  }
+
+  settings.mQuality     = std::clamp(getInt("quality", DEFAULT_CAPTURE_JPEG_QUALITY), 1, 100);
+  settings.mCompression = std::clamp(getInt("compression", DEFAULT_PNG_COMPRESSION), 0, 9);
+
+  auto depthFormat = getParam("depthFormat", "float32");
+  if (depthFormat == "float16") {
+    settings.mDepthFormat = DepthFormat::eFloat16;
+  } else if (depthFormat == "fixed16") {
+    settings.mDepthFormat = DepthFormat::eFixed16;
+  }
+
+  auto depthCompression = getParam("depthCompression", "none");
+  if (depthCompression == "deflate") {
+    settings.mDepthCompression = TIFFCompression::eDeflate;
+  } else if (depthCompression == "lzw") {
+    settings.mDepthCompression = TIFFCompression::eLZW;
+  }
+
+  settings.mDepthMax = std::max(0.F, cs::utils::fromString<float>(getParam("depthMax", "0")));
+
+  settings.mCropX      = std::max(0, getInt("x", 0));
+  settings.mCropY      = std::max(0, getInt("y", 0));
+  settings.mCropWidth  = std::max(0, getInt("w", 0));
+  settings.mCropHeight = std::max(0, getInt("h", 0));
+
+  // A thumbnail is scaled so that its larger side has the given length.
+  float scale = cs::utils::fromString<float>(getParam("scale", "1"));
+  int   thumb = getInt("thumbnail", 0);
+  if (thumb > 0) {
+    auto region = settings.getRegion(settings.mWidth, settings.mHeight);
+    scale = std::min(scale, static_cast<float>(thumb) / std::max(region[2], region[3]));
+  }
+  settings.mScale = std::clamp(scale, 0.001F, 1.F);
+
+  return settings;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Plugin::updateBatch(BatchJob& batch) {
+
+  // If the previous operation was a capture, we have to wait for its result.
+  if (batch.mPendingCapture.valid()) {
+    if (batch.mPendingCapture.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+      return false;
+    }
+
+    try {
+      batch.mResult.mCaptures[batch.mNext - 1] = batch.mPendingCapture.get();
+    } catch (std::future_error const&) {
+      batch.mResult.mResults.back()["status"] = "error";
+      batch.mResult.mResults.back()["error"]  = "The capture has been cancelled.";
+    }
+  }
+
+  // Consecutive /run-js operations are combined into a single executeJavascript() call.
+  std::string javaScript;
+
+  auto flushJavaScript = [this, &javaScript]() {
+    if (!javaScript.empty()) {
+      mGuiManager->getGui()->executeJavascript(javaScript);
+      invalidateSaveCache();
+      javaScript.clear();
+    }
+  };
+
+  while (batch.mNext < batch.mOperations.size() && !batch.mPendingCapture.valid()) {
+    size_t      index     = batch.mNext++;
+    auto const& operation = batch.mOperations[index];
+    auto        result    = nlohmann::json::object();
+
+    try {
+      auto op      = operation.at("op").get<std::string>();
+      result["op"] = op;
+
+      if (op != "run-js") {
+        flushJavaScript();
+      }
+
+      if (op == "load") {
+        mAllSettings->loadFromJson(operation.at("settings").dump());
+      } else if (op == "patch") {
+        applyPatch({operation.value("jsonPatch", false), operation.at("patch")});
+      } else if (op == "run-js") {
+        auto code = operation.at("code").get<std::string>();
+
+        uint64_t id{};
+        {
+          std::lock_guard<std::mutex> lock(mJavaScriptCallsMutex);
+          id = addJavaScriptCall();
+        }
+
+        javaScript += wrapJavaScript(id, code);
+        result["id"] = id;
+      } else if (op == "save") {
+        batch.mResult.mSettings[index] = mAllSettings->saveToJson();
+      } else if (op == "capture") {
+        auto job       = std::make_shared<CaptureJob>();
+        job->mSettings = readCaptureSettings(
+            [&operation](std::string const& name, std::string const& fallback) {
+              auto it = operation.find(name);
+              if (it == operation.end()) {
+                return fallback;
+              }
+              return it->is_string() ? it->get<std::string>() : it->dump();
+            });
+
+        result["contentType"] = job->mSettings.getContentType();
+        batch.mPendingCapture = job->mResult.get_future();
+        mCaptureJobs.push_back(std::move(job));
+      } else {
+        throw std::runtime_error("Unknown operation '" + op + "'!");
+      }
+
+      result["status"] = "ok";
+
+    } catch (std::exception const& e) {
+      result["status"] = "error";
+      result["error"]  = e.what();
+    }
+
+    batch.mResult.mResults.push_back(std::move(result));
+  }
+
+  flushJavaScript();
+
+  return !batch.mPendingCapture.valid();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t Plugin::addJavaScriptCall() {
+  uint64_t id            = mJavaScriptNextId++;
+  mJavaScriptResults[id] = {};
+
+  // Forget the oldest results if there are too many.
+  while (mJavaScriptResults.size() > MAX_JAVASCRIPT_RESULTS) {
+    mJavaScriptResults.erase(mJavaScriptResults.begin());
+  }
+
+  return id;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::applyPatch(SettingsPatch const& patch) {
+  auto apply = [&patch](nlohmann::json const& settings) {
+    if (patch.mJsonPatch) {
+      return settings.patch(patch.mData);
+    }
+    auto result = settings;
+    result.merge_patch(patch.mData);
+    return result;
+  };
+
+  try {
+    // First we apply the patch to the current settings. Comparing the result with the current
+    // settings tells us which values actually change. If the cached /save response is valid, it
+    // is used instead of serializing all settings again.
+    bool cached  = mSaveCacheValid;
+    auto current = nlohmann::json::parse(saveSettings()->mSettings);
+    auto patched = apply(current);
+    auto diff    = nlohmann::json::diff(current, patched);
+
+    if (diff.empty()) {
+      return;
+    }
+
+    // Changes to the observer, the simulation time, the user interface visibility and our own
+    // settings can be applied directly. For all other changes, the settings have to be reloaded
+    // completely.
+    bool observer = false;
+    bool time     = false;
+    bool gui      = false;
+    bool webapi   = false;
+    bool reload   = false;
+
+    for (auto const& operation : diff) {
+      auto path = operation.at("path").get<std::string>();
+
+      if (isInside(path, "/observer")) {
+        observer = true;
+      } else if (isInside(path, "/startDate")) {
+        // "today" is only resolved when the settings are loaded.
+        if (patched.at("startDate") == "today") {
+          reload = true;
+        } else {
+          time = true;
+        }
+      } else if (isInside(path, "/enableUserInterface")) {
+        gui = true;
+      } else if (isInside(path, "/plugins/csp-web-api")) {
+        webapi = true;
+      } else {
+        reload = true;
+      }
+    }
+
+    if (reload) {
+      logger().debug("Patch requires a reload of all settings.");
+
+      // The cache may miss changes which are not observed, for example those made in the user
+      // interface. They would be reverted by the reload, so the current settings are used here.
+      if (cached) {
+        patched = apply(nlohmann::json::parse(mAllSettings->saveToJson()));
+      }
+
+      mAllSettings->loadFromJson(patched.dump());
+      return;
+    }
+
+    if (observer) {
+      auto const& o        = patched.at("observer");
+      auto&       observer = mSolarSystem->getObserver();
+      observer.setCenterName(o.at("center").get<std::string>());
+      observer.setFrameName(o.at("frame").get<std::string>());
+      observer.setAnchorPosition(o.at("position").get<glm::dvec3>());
+      observer.setAnchorRotation(o.at("rotation").get<glm::dquat>());
+    }
+
+    if (time) {
+      mTimeControl->setTime(
+          cs::utils::convert::time::toSpice(patched.at("startDate").get<std::string>()));
+    }
+
+    if (gui) {
+      mAllSettings->pEnableUserInterface = patched.at("enableUserInterface").get<bool>();
+    }
+
+    if (webapi) {
+      mAllSettings->mPlugins["csp-web-api"] = patched.at("plugins").at("csp-web-api");
+      from_json(mAllSettings->mPlugins["csp-web-api"], mPluginSettings);
+
+      // The request limits, the served files and the server options are updated in update().
+      mReloadRequired = true;
+    }
+
+    invalidateSaveCache();
+
+  } catch (std::exception const& e) { logger().error("Failed to apply patch: {}", e.what()); }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool Plugin::ObservedState::operator==(ObservedState const& other) const {
+  return mCenterName == other.mCenterName && mFrameName == other.mFrameName &&
+         mPosition == other.mPosition && mRotation == other.mRotation &&
+         mSimulationTime == other.mSimulationTime && mTimeSpeed == other.mTimeSpeed &&
+         mGui == other.mGui;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::updateRequestLimits() {
+  mLimits.mMaxPendingJavaScript =
+      mPluginSettings.mMaxPendingJavaScript.value_or(DEFAULT_MAX_PENDING_JAVASCRIPT);
+  mLimits.mMaxPendingPatches =
+      mPluginSettings.mMaxPendingPatches.value_or(DEFAULT_MAX_PENDING_PATCHES);
+  mLimits.mMaxPendingCaptures =
+      mPluginSettings.mMaxPendingCaptures.value_or(DEFAULT_MAX_PENDING_CAPTURES);
+  mLimits.mMaxPendingBatches =
+      mPluginSettings.mMaxPendingBatches.value_or(DEFAULT_MAX_PENDING_BATCHES);
+  mLimits.mMaxRequestSize = mPluginSettings.mMaxRequestSize.value_or(DEFAULT_MAX_REQUEST_SIZE);
+  mLimits.mRequestTimeout = mPluginSettings.mRequestTimeout.value_or(DEFAULT_REQUEST_TIMEOUT);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::chrono::milliseconds Plugin::getRequestTimeout() const {
+  return std::chrono::milliseconds(static_cast<int64_t>(mLimits.mRequestTimeout * 1000.0));
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+Plugin::ObservedState Plugin::getObservedState() const {
+  auto const&   observer = mSolarSystem->getObserver();
+  ObservedState state;
+  state.mCenterName     = observer.getCenterName();
+  state.mFrameName      = observer.getFrameName();
+  state.mPosition       = observer.getAnchorPosition();
+  state.mRotation       = observer.getAnchorRotation();
+  state.mSimulationTime = mTimeControl->pSimulationTime.get();
+  state.mTimeSpeed      = mTimeControl->pTimeSpeed.get();
+  state.mGui            = mAllSettings->pEnableUserInterface.get();
+  return state;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::updateStateSnapshot() {
+  auto const&         observer = mSolarSystem->getObserver();
+  auto                position = observer.getAnchorPosition();
+  auto                rotation = observer.getAnchorRotation();
+  auto                now      = std::chrono::system_clock::now().time_since_epoch();
+  StateSnapshot::Data data;
+
+  data.mFrameNumber    = GetVistaSystem()->GetFrameLoop()->GetFrameCount();
+  data.mTimestamp      = std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+  data.mSimulationTime = mTimeControl->pSimulationTime.get();
+  data.mTimeSpeed      = mTimeControl->pTimeSpeed.get();
+  data.mPosition       = {position.x, position.y, position.z};
+  data.mRotation       = {rotation.x, rotation.y, rotation.z, rotation.w};
+  StateSnapshot::setName(data.mCenterName, observer.getCenterName());
+  StateSnapshot::setName(data.mFrameName, observer.getFrameName());
+
+  mStateSnapshot->write(data);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::executePendingJavaScript() {
+  if (!mJavaScript.empty()) {
+    Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eRunJs));
+    mGuiManager->getGui()->executeJavascript(mJavaScript);
+    mJavaScript.clear();
+    invalidateSaveCache();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::invalidateSaveCache() {
+  mSaveCacheValid = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<Plugin::SavedSettings const> Plugin::saveSettings() {
+  if (mSaveCacheValid) {
+    std::lock_guard<std::mutex> lock(mSaveMutex);
+    return mSaveCache;
+  }
+
+  Metrics::ScopedTimer timer(mMetrics->getSection(Metrics::Section::eSave));
+
+  auto saved = std::make_shared<SavedSettings>();
+
+  try {
+    saved->mSettings = mAllSettings->saveToJson();
+    saved->mETag     = computeETag(saved->mSettings);
+  } catch (std::exception const& e) {
+    logger().error("Failed to write settings: {}", e.what());
+    return saved;
+  }
+
+  mSaveCacheTime  = std::chrono::steady_clock::now();
+  mSaveCacheState = getObservedState();
+
+  {
+    std::lock_guard<std::mutex> lock(mSaveMutex);
+    mSaveCache = saved;
+  }
+
+  mSaveCacheValid = true;
+  return saved;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void Plugin::startServer(std::vector<std::string> const& options) {
+
+  // First quit the server as it may be running already.
+  quitServer();
+
+  try {
+    // We start the server with several threads, so that slow requests like /capture do not block
+    // the other endpoints. All requests which modify the scene are executed by the main thread.
+    mServer = std::make_unique<CivetServer>(options);
+
+    for (auto const& handler : mHandlers) {
+      mServer->addHandler(handler.first, *handler.second);
+    }
+
+    mServer->addWebSocketHandler("/events", *mEventChannel);
+
+    mJpegStream->open();
+    mPngStream->open();
+
+  } catch (std::exception const& e) { logger().warn("Failed to start server: {}!", e.what()); }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::vector<std::string> Plugin::getServerOptions(uint16_t port) const {
+  auto timeout = mPluginSettings.mConnectionTimeout.value_or(DEFAULT_CONNECTION_TIMEOUT);
+
+  return {"listening_ports", std::to_string(port), "num_threads",
+      std::to_string(mPluginSettings.mServerThreads.value_or(DEFAULT_SERVER_THREADS)),
+      "enable_keep_alive", mPluginSettings.mKeepAlive.value_or(false) ? "yes" : "no",
+      "request_timeout_ms", std::to_string(static_cast<int64_t>(timeout * 1000.0)),
+      "listen_backlog",
+      std::to_string(mPluginSettings.mListenBacklog.value_or(DEFAULT_LISTEN_BACKLOG))};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
 
 void Plugin::quitServer() {
+
+  // Stopping the server waits for all requests to be finished. Hence, we have to make sure that all
+  // /stream requests return.
+  mJpegStream->close();
+  mPngStream->close();
+
   try {
     if (mServer) {
       mServer.reset();
@@ -9,19 +9,43 @@
 
 #include "../../../src/cs-core/PluginBase.hpp"
 #include "../../../src/cs-utils/DefaultProperty.hpp"
+#include "ImageEncoder.hpp"
+#include "PixelReadback.hpp"
+#include "TaskQueue.hpp"
 
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
 #include <deque>
+#include <functional>
+#include <future>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <nlohmann/json.hpp>
 #include <optional>
-#include <queue>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 class CivetServer;
 class CivetHandler;
 
 namespace csp::webapi {
 
+class Downsampler;
+class EventChannel;
+class FrameStream;
+class LogBuffer;
+class Metrics;
+class StateSnapshot;
+class StaticFileCache;
+class ThreadPool;
+
 /// This plugin contains a web server which provides some HTTP endpoints which can be used to
 /// remote-control CosmoScout VR.
 class Plugin : public cs::core::PluginBase {
@@ -32,9 +56,54 @@ class Plugin : public cs::core::PluginBase {
 
     /// You can provide a path to an html file which will be served when a GET request is sent to
     /// localhost:mPort, for example by a web browser. The path must be relative to the cosmoscout
-    /// executable. Note that no other files are served by the server, so the given html file should
-    /// not depend on other local resources.
+    /// executable. Unless mStaticDirectory is given, no other files are served by the server, so
+    /// the given html file should not depend on other local resources.
     std::optional<std::string> mPage;
+
+    /// A directory relative to the cosmoscout executable whose files are served for all GET
+    /// requests which do not match one of the endpoints, for example "../share/resources/gui". The
+    /// files are kept in memory after their first request. If no page is given, requests for the
+    /// root document are answered with the index.html of this directory.
+    std::optional<std::string> mStaticDirectory;
+
+    /// The /save endpoint caches the serialized settings. The cache is invalidated whenever the
+    /// settings are loaded, JavaScript is executed, or the observer or the simulation time change.
+    /// As some changes (for example via the user interface) cannot be detected, the cache is also
+    /// invalidated after this many seconds. Defaults to 5.
+    std::optional<double> mSaveCacheMaxAge;
+
+    /// Requests are rejected with "429 Too Many Requests" if too many of them are pending. These
+    /// are the maximum numbers of pending JavaScript snippets, patches, captures and batches.
+    /// Default to 1000, 100, 20 and 20.
+    std::optional<uint32_t> mMaxPendingJavaScript;
+    std::optional<uint32_t> mMaxPendingPatches;
+    std::optional<uint32_t> mMaxPendingCaptures;
+    std::optional<uint32_t> mMaxPendingBatches;
+
+    /// POST requests with a larger body are rejected with "413 Payload Too Large". Defaults to
+    /// 16 MiB.
+    std::optional<uint32_t> mMaxRequestSize;
+
+    /// /save, /capture and /batch requests give up waiting for the main thread after this many
+    /// seconds and respond with "503 Service Unavailable". Defaults to 60.
+    std::optional<double> mRequestTimeout;
+
+    /// The number of threads which handle requests. Requests which only read state, like /log,
+    /// /state or /metrics, do not wait for the main thread, so they are served even if other
+    /// threads are waiting for captures. Each open /stream or /events connection occupies one
+    /// thread. Defaults to 8.
+    std::optional<uint32_t> mServerThreads;
+
+    /// If enabled, clients can send several requests over one connection. The connection occupies
+    /// a thread as long as it is kept open. Defaults to false.
+    std::optional<bool> mKeepAlive;
+
+    /// Connections are closed if receiving or sending data takes longer than this many seconds.
+    /// Defaults to 30.
+    std::optional<double> mConnectionTimeout;
+
+    /// The maximum number of connections which wait to be accepted. Defaults to 200.
+    std::optional<uint32_t> mListenBacklog;
   };
 
   void init() override;
@@ -43,47 +112,393 @@ class Plugin : public cs::core::PluginBase {
   void update() override;
 
  private:
-  void startServer(uint16_t port);
+  /// Window captures are limited to this size, offscreen captures may be much larger as they are
+  /// assembled from several tiles.
+  static const int32_t MAX_WINDOW_CAPTURE_SIZE    = 2000;
+  static const int32_t MAX_OFFSCREEN_CAPTURE_SIZE = 8192;
+
+  /// The maximum age of the cached /save response, if not configured otherwise. Longer ages may
+  /// return stale settings if they are changed elsewhere, e.g. through the user interface.
+  static constexpr double DEFAULT_SAVE_CACHE_MAX_AGE = 0.0;
+
+  /// The defaults of the corresponding settings.
+  static const uint32_t   DEFAULT_MAX_PENDING_JAVASCRIPT = 1000;
+  static const uint32_t   DEFAULT_MAX_PENDING_PATCHES    = 100;
+  static const uint32_t   DEFAULT_MAX_PENDING_CAPTURES   = 20;
+  static const uint32_t   DEFAULT_MAX_PENDING_BATCHES    = 20;
+  static const uint32_t   DEFAULT_MAX_REQUEST_SIZE       = 16 * 1024 * 1024;
+  static constexpr double DEFAULT_REQUEST_TIMEOUT        = 60.0;
+  static const uint32_t   DEFAULT_SERVER_THREADS         = 8;
+  static constexpr double DEFAULT_CONNECTION_TIMEOUT     = 30.0;
+  static const uint32_t   DEFAULT_LISTEN_BACKLOG         = 200;
+
+  /// At most this many bytes of static files are kept in memory.
+  static const size_t MAX_STATIC_CACHE_SIZE = 64 * 1024 * 1024;
+
+  /// The quality of the JPEG images sent by the /stream endpoint.
+  static const int32_t STREAM_JPEG_QUALITY = 80;
+
+  /// The quality of JPEG captures, if not given otherwise.
+  static const int32_t DEFAULT_CAPTURE_JPEG_QUALITY = 90;
+
+  /// The tasks posted by the server threads are executed until this much time has passed in a
+  /// frame. The remaining tasks are executed in the following frames.
+  static constexpr std::chrono::microseconds TASK_FRAME_BUDGET{2000};
+
+  /// At most this many /run-js calls are executed in a frame. Once they have been collected, the
+  /// following tasks are left for the next frame, so that they are still executed in order.
+  static const uint32_t MAX_JAVASCRIPT_CALLS_PER_FRAME = 100;
+
+  /// The results of at most this many /run-js calls are kept.
+  static const size_t MAX_JAVASCRIPT_RESULTS = 1000;
+
+  /// A /capture-sequence request may contain at most this many frames. Only
+  /// MAX_SEQUENCE_FRAMES_AHEAD frames more than have been sent to the client are requested from the
+  /// main thread, so that the encoded frames do not pile up in memory if the client is slow.
+  static const int32_t MAX_SEQUENCE_FRAMES       = 100000;
+  static const int32_t MAX_SEQUENCE_FRAMES_AHEAD = 8;
+
+  /// The parameters of a /capture request. Requests with equal parameters are served with the
+  /// same image.
+  struct CaptureSettings {
+    int32_t         mWidth            = 800;
+    int32_t         mHeight           = 600;
+    int32_t         mDelay            = 50;
+    bool            mGui              = false;
+    bool            mDepth            = false;
+    bool            mOffscreen        = false;
+    ImageFormat     mFormat           = ImageFormat::ePNG;
+    int32_t         mQuality          = DEFAULT_CAPTURE_JPEG_QUALITY;
+    int32_t         mCompression      = DEFAULT_PNG_COMPRESSION;
+    DepthFormat     mDepthFormat      = DepthFormat::eFloat32;
+    TIFFCompression mDepthCompression = TIFFCompression::eNone;
+
+    /// The distance in meters which corresponds to the largest value of eFixed16 depth images. If
+    /// this is zero, the far clipping distance is used.
+    float mDepthMax = 0.F;
+
+    /// The region of the image which should be captured, with the origin at the top left. If the
+    /// width or height is zero, the region extends to the right or bottom border of the image.
+    int32_t mCropX      = 0;
+    int32_t mCropY      = 0;
+    int32_t mCropWidth  = 0;
+    int32_t mCropHeight = 0;
+
+    /// The cropped region is scaled by this factor. For window captures, this is done on the GPU
+    /// before the pixels are read. Offscreen captures are directly rendered at the lower
+    /// resolution.
+    float mScale = 1.F;
+
+    /// Returns the cropped region of an image with the given size as x, y, width and height. The
+    /// origin is at the bottom left, as in OpenGL.
+    std::array<int32_t, 4> getRegion(int32_t imageWidth, int32_t imageHeight) const;
+
+    /// Returns the given size multiplied by mScale, but at least one.
+    int32_t getScaledSize(int32_t size) const;
+
+    /// Returns the MIME type of the encoded image. Depth images are always TIFF images.
+    char const* getContentType() const;
+
+    /// Returns the file name extension of the encoded image, without the leading dot.
+    char const* getFileExtension() const;
+
+    bool operator==(CaptureSettings const& other) const;
+  };
+
+  /// Each /capture request creates one of these jobs. The promise is fulfilled once the image has
+  /// been encoded. If the capture failed, the result will be empty. If the request times out
+  /// before the capture started, the job is cancelled and dropped by the main thread. The HTTP
+  /// thread does not own the job, so the promise is broken if the job is dropped.
+  struct CaptureJob {
+    CaptureSettings                                             mSettings;
+    std::promise<std::shared_ptr<std::vector<std::byte> const>> mResult;
+    std::atomic<bool>                                           mCancelled{false};
+  };
+
+  /// The results of a /batch request. Saved settings and captured images are stored separately
+  /// from the results, so that they can be converted to JSON by the HTTP thread.
+  struct BatchResult {
+    std::vector<nlohmann::json>                                     mResults;
+    std::map<size_t, std::string>                                   mSettings;
+    std::map<size_t, std::shared_ptr<std::vector<std::byte> const>> mCaptures;
+  };
+
+  /// A /batch request. Its operations are executed one after another by the main thread. If an
+  /// operation is a capture, the remaining operations are postponed until the image is available.
+  /// Once all operations are done, the result is handed to the HTTP thread through mDone. The job
+  /// itself is only owned by the main thread, so the promise is broken if the job is dropped.
+  struct BatchJob {
+    nlohmann::json                                             mOperations;
+    size_t                                                     mNext = 0;
+    BatchResult                                                mResult;
+    std::future<std::shared_ptr<std::vector<std::byte> const>> mPendingCapture;
+    std::promise<BatchResult>                                  mDone;
+  };
+
+  // The request limits from the plugin settings. They are copied to these atomics by the main
+  // thread, so that they can be safely accessed by the server threads.
+  struct RequestLimits {
+    std::atomic<uint32_t> mMaxPendingJavaScript{DEFAULT_MAX_PENDING_JAVASCRIPT};
+    std::atomic<uint32_t> mMaxPendingPatches{DEFAULT_MAX_PENDING_PATCHES};
+    std::atomic<uint32_t> mMaxPendingCaptures{DEFAULT_MAX_PENDING_CAPTURES};
+    std::atomic<uint32_t> mMaxPendingBatches{DEFAULT_MAX_PENDING_BATCHES};
+    std::atomic<uint32_t> mMaxRequestSize{DEFAULT_MAX_REQUEST_SIZE};
+    std::atomic<double>   mRequestTimeout{DEFAULT_REQUEST_TIMEOUT};
+  };
+
+  // The numbers of accepted requests which have not been processed by the main thread yet. They
+  // are incremented by the server threads and checked against the RequestLimits. mModifications
+  // counts the /load, /patch, /run-js and /batch requests which may still change the settings. It
+  // is only decremented once they have been applied; while it is not zero, /save does not use the
+  // cached settings.
+  struct PendingCounts {
+    std::atomic<uint32_t> mJavaScript{0};
+    std::atomic<uint32_t> mPatches{0};
+    std::atomic<uint32_t> mBatches{0};
+    std::atomic<uint32_t> mCaptures{0};
+    std::atomic<uint32_t> mModifications{0};
+  };
+
+  struct JavaScriptResult {
+    bool        mDone = false;
+    std::string mResult;
+    std::string mError;
+  };
+
+  // A pending /patch request. Either an RFC 7386 merge patch or an RFC 6902 JSON patch.
+  struct SettingsPatch {
+    bool           mJsonPatch = false;
+    nlohmann::json mData;
+  };
+
+  // The part of the scene state which is checked each frame for changes in order to invalidate the
+  // cached /save response.
+  struct ObservedState {
+    std::string mCenterName;
+    std::string mFrameName;
+    glm::dvec3  mPosition;
+    glm::dquat  mRotation;
+    double      mSimulationTime = 0.0;
+    double      mTimeSpeed      = 0.0;
+    bool        mGui            = false;
+
+    bool operator==(ObservedState const& other) const;
+  };
+
+  // The serialized settings returned by /save together with their ETag. Both are empty if the
+  // settings could not be serialized.
+  struct SavedSettings {
+    std::string mSettings;
+    std::string mETag;
+  };
+
+  // When capturing in offscreen mode, the image is assembled from several tiles, each having the
+  // size of the window. For each tile, the projection plane extents are adjusted so that the tile
+  // fills the entire window. The tiles are read directly into one pixel-pack buffer. mWidth and
+  // mHeight are the size of the image after cropping and scaling.
+  struct OffscreenCapture {
+    int32_t               mReadback     = -1;
+    int32_t               mWidth        = 0;
+    int32_t               mHeight       = 0;
+    int32_t               mTile         = 0;
+    int32_t               mTilesX       = 0;
+    int32_t               mTilesY       = 0;
+    int32_t               mWindowWidth  = 0;
+    int32_t               mWindowHeight = 0;
+    double                mLeft         = 0.0;
+    double                mBottom       = 0.0;
+    double                mPixelSize    = 0.0;
+    std::array<double, 4> mOriginalExtents{};
+    bool                  mOriginalGui = true;
+  };
+
+  // This is the capture which is currently processed by the main thread. It serves all jobs with
+  // equal settings which arrive before its pixels are read. Exclusive captures belong to a
+  // /capture-sequence and show a specific state of the scene, so they serve no other jobs.
+  struct ActiveCapture {
+    CaptureSettings                          mSettings;
+    std::vector<std::shared_ptr<CaptureJob>> mJobs;
+    int32_t                                  mAtFrame   = 0;
+    bool                                     mExclusive = false;
+    std::optional<OffscreenCapture>          mOffscreen;
+  };
+
+  // A point on the observer path of a /capture-sequence. If the names are empty, the current
+  // center and frame of the observer are kept.
+  struct SequenceKeyframe {
+    std::string mCenterName;
+    std::string mFrameName;
+    glm::dvec3  mPosition{};
+    glm::dquat  mRotation{};
+  };
+
+  // A /capture-sequence request. Its frames are captured one after another by the main thread,
+  // each one after the simulation time and the observer have been set. The HTTP thread sends the
+  // encoded frames while the following frames are rendered and encoded. mFrames contains the jobs
+  // of the frames which have been requested by the HTTP thread but not yet captured. mCancelled is
+  // written by the HTTP thread, all other members are only accessed by the main thread. Like
+  // CaptureJobs, the sequence is only owned by the main thread.
+  struct SequenceJob {
+    CaptureSettings                         mSettings;
+    int32_t                                 mSettleFrames = 1;
+    double                                  mTimeStep     = 0.0;
+    std::vector<SequenceKeyframe>           mPath;
+    int32_t                                 mFrameCount = 0;
+    std::deque<std::shared_ptr<CaptureJob>> mFrames;
+    int32_t                                 mNext              = 0;
+    double                                  mStartTime         = 0.0;
+    float                                   mOriginalTimeSpeed = 0.F;
+    std::atomic<bool>                       mCancelled{false};
+  };
+
+  /// Reads the parameters of a /capture request. The given function has to return the value of
+  /// the parameter with the given name, or the given default value if it is not present.
+  static CaptureSettings readCaptureSettings(
+      std::function<std::string(std::string const&, std::string const&)> const& getParam);
+
+  /// Executes the operations of the given batch until a capture has to be waited for. Returns true
+  /// if all operations have been executed.
+  bool updateBatch(BatchJob& batch);
+
+  /// Reserves a result slot for a new /run-js call and returns its ID. mJavaScriptCallsMutex has
+  /// to be locked when calling this.
+  uint64_t addJavaScriptCall();
+
+  void applyPatch(SettingsPatch const& patch);
+  void updateRequestLimits();
+
+  /// Returns the configured request timeout.
+  std::chrono::milliseconds getRequestTimeout() const;
+
+  /// Copies the current observer and time state to mStateSnapshot for the /state endpoint.
+  void updateStateSnapshot();
+
+  ObservedState getObservedState() const;
+  void          invalidateSaveCache();
+
+  /// Returns the cached settings if they are still valid. Else the settings are serialized and
+  /// cached. This must only be called by the main thread.
+  std::shared_ptr<SavedSettings const> saveSettings();
+
+  /// Executes the code of all /run-js calls which have been collected in mJavaScript.
+  void executePendingJavaScript();
+
+  /// Returns the CivetServer options according to the plugin settings.
+  std::vector<std::string> getServerOptions(uint16_t port) const;
+
+  /// Stops the running server, if any, and starts a new one with the given options. Stopping the
+  /// server waits for all running requests, which may wait for the main thread in turn. Hence,
+  /// this is called on mServerThread while the server is running.
+  void startServer(std::vector<std::string> const& options);
   void quitServer();
 
+  /// Moves all pending jobs with the same settings as the active capture to the active capture.
+  void collectCaptureJobs();
+
+  /// Sets the simulation time and the observer for the next frame of mSequence and starts its
+  /// capture. Drops mSequence once all frames have been captured or the client disconnected.
+  void updateSequence();
+
+  /// Returns a callback for the PixelReadback which encodes the pixels on the encoder threads and
+  /// fulfills the promises of all jobs of the active capture once this is done.
+  PixelReadback::Callback encodeCapture(int32_t width, int32_t height);
+
+  /// Reads the window's pixels and encodes them for all streams which are waiting for a frame.
+  void updateStreams();
+
+  void beginWindowCapture();
+  void updateWindowCapture();
+  bool beginOffscreenCapture();
+  void setupOffscreenTile();
+  void updateOffscreenCapture();
+
+  /// Restores the projection plane extents and the user interface which have been changed for
+  /// the tiles of the active offscreen capture.
+  void endOffscreenCapture();
+
+  /// Drops the active capture, if any, without reading its pixels. A partially read offscreen
+  /// capture restores the projection and the user interface and releases its pixel-pack buffer.
+  void abortActiveCapture();
+
   Settings                                                       mPluginSettings;
   std::unique_ptr<CivetServer>                                   mServer;
   std::unordered_map<std::string, std::unique_ptr<CivetHandler>> mHandlers;
+  std::vector<std::string>                                       mServerOptions;
+  std::thread                                                    mServerThread;
+  std::atomic<bool>                                              mServerRestarting{false};
+  RequestLimits                                                  mLimits;
+  PendingCounts                                                  mPending;
+  std::unique_ptr<Metrics>                                       mMetrics;
+  std::unique_ptr<StateSnapshot>                                 mStateSnapshot;
+  std::unique_ptr<StaticFileCache>                               mStaticFiles;
+
+  // All work which has to be done by the main thread is posted to this queue. This includes the
+  // /run-js, /save, /load and /patch requests as well as the start of all captures and batches.
+  std::unique_ptr<TaskQueue> mTasks;
 
-  // Members for the /capture endpoint
-  std::mutex              mCaptureMutex;
-  std::condition_variable mCaptureDone;
-  bool                    mCaptureRequested = false;
-  int32_t                 mCaptureWidth     = 0;
-  int32_t                 mCaptureHeight    = 0;
-  int32_t                 mCaptureDelay     = 0;
-  bool                    mCaptureGui       = false;
-  bool                    mCaptureDepth     = false;
-  int32_t                 mCaptureAtFrame   = 0;
-  std::vector<std::byte>  mCapture;
+  // Members for the /capture endpoint. The jobs are posted by the server's worker threads and
+  // processed one after another by the main thread. Only the main thread accesses these members.
+  std::deque<std::shared_ptr<CaptureJob>> mCaptureJobs;
+  std::unique_ptr<ActiveCapture>          mActiveCapture;
+
+  // The running /capture-sequence, if any. Only one sequence can run at a time. While it runs, no
+  // other captures are started. mSequenceRunning is set by the server thread which starts the
+  // sequence and reset by the main thread once the sequence is dropped.
+  std::shared_ptr<SequenceJob> mSequence;
+  std::atomic<bool>            mSequenceRunning{false};
+
+  // The pixels for the /capture endpoint are read asynchronously and encoded on a separate thread.
+  std::unique_ptr<PixelReadback> mPixelReadback;
+  std::unique_ptr<Downsampler>   mDownsampler;
+  std::unique_ptr<ThreadPool>    mEncoderPool;
+
+  // Members for the /stream endpoint. There is one stream for each supported image format.
+  std::unique_ptr<FrameStream> mJpegStream;
+  std::unique_ptr<FrameStream> mPngStream;
 
   // Members for the /log endpoint
-  std::mutex              mLogMutex;
-  std::deque<std::string> mLogMessages;
+  std::unique_ptr<LogBuffer> mLogBuffer;
+
+  // The /events WebSocket endpoint
+  std::unique_ptr<EventChannel> mEventChannel;
+
+  // Members for the /save endpoint. The last serialized settings are cached together with the
+  // scene state at the time of serialization. The server threads read the cache without waiting
+  // for the main thread as long as mSaveCacheValid is set. mSaveMutex only guards the pointer.
+  std::mutex                            mSaveMutex;
+  std::shared_ptr<SavedSettings const>  mSaveCache;
+  std::atomic<bool>                     mSaveCacheValid{false};
+  std::chrono::steady_clock::time_point mSaveCacheTime;
+  ObservedState                         mSaveCacheState;
 
-  // Members for the /save endpoint
-  std::mutex              mSaveMutex;
-  std::condition_variable mSaveDone;
-  bool                    mSaveRequested = false;
-  std::string             mSaveSettings;
+  // Members for the /load endpoint. mLoadSettings contains the settings which will be loaded by
+  // the most recently posted /load task, mLoadTask identifies this task. Both are reset once the
+  // task has taken the settings.
+  std::mutex                   mLoadMutex;
+  std::shared_ptr<std::string> mLoadSettings;
+  TaskQueue::TaskId            mLoadTask = nullptr;
 
-  // Members for the /load endpoint
-  std::mutex  mLoadMutex;
-  std::string mLoadSettings;
+  // Members for the /batch endpoint. They are only accessed by the main thread.
+  std::deque<std::shared_ptr<BatchJob>> mBatches;
 
-  // Members for the /run-js endpoint
-  std::mutex              mJavaScriptCallsMutex;
-  std::queue<std::string> mJavaScriptCalls;
+  // Members for the /run-js and /run-js-result endpoints. The code of the /run-js calls executed
+  // in a frame is collected in mJavaScript by the main thread. mJavaScriptCallsInFrame counts
+  // these calls.
+  std::string                          mJavaScript;
+  uint32_t                             mJavaScriptCallsInFrame = 0;
+  std::mutex                           mJavaScriptCallsMutex;
+  uint64_t                             mJavaScriptNextId = 1;
+  std::map<uint64_t, JavaScriptResult> mJavaScriptResults;
+  std::condition_variable              mJavaScriptResultsChanged;
 
   int  mOnLoadConnection       = -1;
   int  mOnSaveConnection       = -1;
   int  mOnLogMessageConnection = -1;
+  int  mOnGuiConnection        = -1;
+  int  mOnTimeConnection       = -1;
+  int  mOnTimeSpeedConnection  = -1;
   bool mReloadRequired         = true;
+  bool mServerRestartRequired  = false;
 };
 
 } // namespace csp::webapi
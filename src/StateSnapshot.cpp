@@ -0,0 +1,137 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "StateSnapshot.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Appends the given value in little-endian byte order.
+template <typename T>
+void appendLittleEndian(std::string& out, T value) {
+  static_assert(sizeof(T) == sizeof(uint64_t));
+
+  uint64_t bits = 0;
+  std::memcpy(&bits, &value, sizeof(T));
+  for (size_t i(0); i < sizeof(T); ++i) {
+    out.push_back(static_cast<char>((bits >> (i * 8U)) & 0xffU));
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void appendName(std::string& out, char const* name) {
+  auto length = std::strlen(name);
+  out.push_back(static_cast<char>(length));
+  out.append(name, length);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void to_json(nlohmann::json& j, StateSnapshot::Data const& o) {
+  j = {{"frameNumber", o.mFrameNumber}, {"timestamp", o.mTimestamp},
+      {"simulationTime", o.mSimulationTime}, {"timeSpeed", o.mTimeSpeed},
+      {"observer", {{"center", o.mCenterName.data()}, {"frame", o.mFrameName.data()},
+                       {"position", o.mPosition}, {"rotation", o.mRotation}}}};
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void StateSnapshot::write(Data const& data) {
+  std::array<uint64_t, WORD_COUNT> words{};
+  std::memcpy(words.data(), &data, sizeof(Data));
+
+  // An odd sequence number tells readers that a write is in progress. The release fence makes sure
+  // that this is visible before any of the words are modified.
+  auto sequence = mSequence.load(std::memory_order_relaxed);
+  mSequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for (size_t i(0); i < WORD_COUNT; ++i) {
+    mWords[i].store(words[i], std::memory_order_relaxed);
+  }
+
+  mSequence.store(sequence + 2, std::memory_order_release);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool StateSnapshot::read(Data& data) const {
+  std::array<uint64_t, WORD_COUNT> words{};
+
+  while (true) {
+    auto before = mSequence.load(std::memory_order_acquire);
+
+    if (before == 0) {
+      return false;
+    }
+
+    if (before % 2 == 0) {
+      for (size_t i(0); i < WORD_COUNT; ++i) {
+        words[i] = mWords[i].load(std::memory_order_relaxed);
+      }
+
+      // The acquire fence makes sure that the words are read before the sequence number is checked
+      // again. If it did not change, the copy is consistent.
+      std::atomic_thread_fence(std::memory_order_acquire);
+
+      if (mSequence.load(std::memory_order_relaxed) == before) {
+        break;
+      }
+    }
+  }
+
+  std::memcpy(static_cast<void*>(&data), words.data(), sizeof(Data));
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void StateSnapshot::setName(
+    std::array<char, MAX_NAME_LENGTH + 1>& target, std::string const& name) {
+  auto length = std::min(name.size(), MAX_NAME_LENGTH);
+  std::copy_n(name.data(), length, target.data());
+  target[length] = '\0';
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string StateSnapshot::toBinary(Data const& data) {
+  std::string result;
+  result.reserve(10 * sizeof(uint64_t) + 2 * (MAX_NAME_LENGTH + 1));
+
+  appendLittleEndian(result, data.mFrameNumber);
+  appendLittleEndian(result, data.mTimestamp);
+  appendLittleEndian(result, data.mSimulationTime);
+  appendLittleEndian(result, data.mTimeSpeed);
+
+  for (double value : data.mPosition) {
+    appendLittleEndian(result, value);
+  }
+
+  for (double value : data.mRotation) {
+    appendLittleEndian(result, value);
+  }
+
+  appendName(result, data.mCenterName.data());
+  appendName(result, data.mFrameName.data());
+
+  return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
@@ -0,0 +1,73 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_STATE_SNAPSHOT_HPP
+#define CSP_WEB_API_STATE_SNAPSHOT_HPP
+
+#include <nlohmann/json.hpp>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+namespace csp::webapi {
+
+/// This class stores a copy of the observer and time state which is written once per frame by the
+/// main thread and can be read by any number of threads without ever blocking the writer. It is
+/// implemented as a sequence lock: The writer increments a sequence number before and after
+/// writing, and readers retry if the number was odd or changed while they were copying. As only
+/// about two hundred bytes are copied, readers practically never have to retry.
+/// There must be only one writer at a time, but any number of concurrent readers.
+class StateSnapshot {
+ public:
+  static const size_t MAX_NAME_LENGTH = 63;
+
+  struct Data {
+    uint64_t                              mFrameNumber    = 0;
+    int64_t                               mTimestamp      = 0; ///< Milliseconds since the epoch.
+    double                                mSimulationTime = 0.0;
+    double                                mTimeSpeed      = 0.0;
+    std::array<double, 3>                 mPosition{};
+    std::array<double, 4>                 mRotation{}; ///< x, y, z, w
+    std::array<char, MAX_NAME_LENGTH + 1> mCenterName{};
+    std::array<char, MAX_NAME_LENGTH + 1> mFrameName{};
+  };
+
+  static_assert(std::is_trivially_copyable_v<Data>);
+
+  /// Stores a new state. This must not be called concurrently.
+  void write(Data const& data);
+
+  /// Copies the most recently written state to the given data. Returns false if nothing has been
+  /// written yet.
+  bool read(Data& data) const;
+
+  /// Copies the given string to one of the name fields of Data, truncating it if necessary.
+  static void setName(std::array<char, MAX_NAME_LENGTH + 1>& target, std::string const& name);
+
+  /// Serializes the given state into the compact binary format of the /state endpoint. All values
+  /// are stored in little-endian byte order:
+  ///   uint64 frame number, int64 timestamp, float64 simulation time, float64 time speed,
+  ///   3 x float64 position, 4 x float64 rotation (x, y, z, w),
+  ///   uint8 length + center name, uint8 length + frame name
+  static std::string toBinary(Data const& data);
+
+ private:
+  static const size_t WORD_COUNT = (sizeof(Data) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  // The data is stored as an array of atomic words. This way, concurrent reads and writes are no
+  // data races, and relaxed loads and stores compile to plain memory accesses.
+  std::atomic<uint64_t>                         mSequence{0};
+  std::array<std::atomic<uint64_t>, WORD_COUNT> mWords{};
+};
+
+void to_json(nlohmann::json& j, StateSnapshot::Data const& o);
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_STATE_SNAPSHOT_HPP
@@ -0,0 +1,178 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "StaticFileCache.hpp"
+
+#include "ImageEncoder.hpp"
+
+#include <civetweb.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Images, fonts and the like are already compressed, so only these types are gzipped.
+bool isCompressible(std::string const& contentType) {
+  return contentType.rfind("text/", 0) == 0 ||
+         contentType.find("javascript") != std::string::npos ||
+         contentType.find("json") != std::string::npos ||
+         contentType.find("xml") != std::string::npos ||
+         contentType.find("wasm") != std::string::npos;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+StaticFileCache::StaticFileCache(size_t maxSize)
+    : mMaxSize(maxSize) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<StaticFileCache::File const> StaticFileCache::get(std::string const& path) {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto                        it = mFiles.find(path);
+    if (it != mFiles.end()) {
+      return it->second;
+    }
+  }
+
+  // The file is loaded and compressed without holding the lock, so that requests for other files
+  // are not blocked. If the same file is requested concurrently, it may be loaded twice.
+  auto file = load(path);
+
+  if (file) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    size_t                      size = file->mData.size() + file->mGzipData.size();
+    if (mSize + size <= mMaxSize && mFiles.emplace(path, file).second) {
+      mSize += size;
+    }
+  }
+
+  return file;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void StaticFileCache::setSources(
+    std::optional<std::string> page, std::optional<std::string> directory) {
+  std::lock_guard<std::mutex> lock(mMutex);
+  mPage      = std::move(page);
+  mDirectory = std::move(directory);
+  mFiles.clear();
+  mSize = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool StaticFileCache::hasSources() {
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mPage || mDirectory;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::optional<std::string> StaticFileCache::getPath(std::string const& uri) {
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  if (mPage && (uri == "/" || !mDirectory)) {
+    return mPage;
+  }
+
+  if (mDirectory) {
+    return resolve(mDirectory.value(), uri);
+  }
+
+  return std::nullopt;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::optional<std::string> StaticFileCache::resolve(
+    std::string const& directory, std::string const& uri) {
+
+  if (uri.empty() || uri[0] != '/' || uri.find('\\') != std::string::npos ||
+      uri.find('\0') != std::string::npos) {
+    return std::nullopt;
+  }
+
+  for (size_t start(1); start <= uri.size();) {
+    size_t end = std::min(uri.find('/', start), uri.size());
+    if (uri.compare(start, end - start, "..") == 0) {
+      return std::nullopt;
+    }
+    start = end + 1;
+  }
+
+  std::string path = directory + uri;
+  if (path.back() == '/') {
+    path += "index.html";
+  }
+
+  return path;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::shared_ptr<StaticFileCache::File const> StaticFileCache::load(std::string const& path) {
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(path, error)) {
+    return nullptr;
+  }
+
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    return nullptr;
+  }
+
+  auto file          = std::make_shared<File>();
+  file->mData        = std::string(std::istreambuf_iterator<char>(stream), {});
+  file->mContentType = mg_get_builtin_mime_type(path.c_str());
+  file->mETag        = computeETag(file->mData);
+
+  // Both variants are different representations of the file, so they need different ETags. The
+  // compressed variant is only kept if it saves at least ten percent.
+  if (isCompressible(file->mContentType)) {
+    auto gzip = compressGzip(file->mData);
+    if (!gzip.empty() && gzip.size() < file->mData.size() * 9 / 10) {
+      file->mGzipData = std::move(gzip);
+      file->mGzipETag = file->mETag.substr(0, file->mETag.size() - 1) + "-gzip\"";
+    }
+  }
+
+  return file;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+std::string computeETag(std::string const& data) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : data) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ULL;
+  }
+
+  std::array<char, 20> etag{};
+  std::snprintf(etag.data(), etag.size(), "\"%016llx\"", static_cast<unsigned long long>(hash));
+  return etag.data();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
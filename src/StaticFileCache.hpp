@@ -0,0 +1,75 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_STATIC_FILE_CACHE_HPP
+#define CSP_WEB_API_STATIC_FILE_CACHE_HPP
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+namespace csp::webapi {
+
+/// This class keeps the files served by the web server in memory. Each file is read from disk on
+/// its first request only. At this point, its ETag and, for text-based formats, a gzip-compressed
+/// variant are computed as well. Files are not reloaded when they change on disk; they are dropped
+/// when the sources are set again. All methods are thread-safe.
+class StaticFileCache {
+ public:
+  struct File {
+    std::string mContentType;
+    std::string mData;
+    std::string mETag;
+
+    /// These are empty if the file is not compressible or compression does not make it smaller.
+    std::string mGzipData;
+    std::string mGzipETag;
+  };
+
+  /// Files are only kept in memory as long as the total size of all cached files (including their
+  /// compressed variants) does not exceed maxSize bytes. Further files are read from disk on each
+  /// request.
+  explicit StaticFileCache(size_t maxSize);
+
+  /// Returns the file at the given path. Returns nullptr if it does not exist or cannot be read.
+  std::shared_ptr<File const> get(std::string const& path);
+
+  /// Sets the file which is served for the root document and the directory from which all other
+  /// paths are served. Both are optional. This also removes all files from the cache.
+  void setSources(std::optional<std::string> page, std::optional<std::string> directory);
+
+  /// Returns true if a page or a directory has been set.
+  bool hasSources();
+
+  /// Returns the file which should be served for the given decoded request path. If no directory
+  /// is set, the page is served for all paths. Returns std::nullopt if there is no such file.
+  std::optional<std::string> getPath(std::string const& uri);
+
+  /// Maps the decoded path of a request URI to a file in the given directory. Paths ending with a
+  /// slash are mapped to the index.html of the respective directory. Returns std::nullopt if the
+  /// path contains ".." segments or backslashes, so that no files outside the directory are served.
+  static std::optional<std::string> resolve(std::string const& directory, std::string const& uri);
+
+ private:
+  static std::shared_ptr<File const> load(std::string const& path);
+
+  std::mutex                                                   mMutex;
+  std::optional<std::string>                                   mPage;
+  std::optional<std::string>                                   mDirectory;
+  std::unordered_map<std::string, std::shared_ptr<File const>> mFiles;
+  size_t                                                       mMaxSize;
+  size_t                                                       mSize = 0;
+};
+
+/// Computes a 64 bit FNV-1a hash of the given string and returns it as a quoted hex string which
+/// can be used as an ETag.
+std::string computeETag(std::string const& data);
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_STATIC_FILE_CACHE_HPP
@@ -0,0 +1,103 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "TaskQueue.hpp"
+
+#include "logger.hpp"
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TaskQueue::TaskQueue()
+    : mHead(new Node)
+    , mTail(mHead.load()) {
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TaskQueue::~TaskQueue() {
+  clear();
+  delete mTail;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+TaskQueue::TaskId TaskQueue::post(std::function<void()> task) {
+  auto* node  = new Node;
+  node->mTask = std::move(task);
+
+  // After the exchange, the node is the new head. It becomes visible to the main thread once the
+  // previous head links to it.
+  Node* previous = mHead.exchange(node, std::memory_order_acq_rel);
+  previous->mNext.store(node, std::memory_order_release);
+
+  return node;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool TaskQueue::isLast(TaskId task) const {
+  // The head is only compared, never dereferenced, as it may be freed concurrently.
+  return mHead.load(std::memory_order_acquire) == task;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool TaskQueue::empty() const {
+  return mTail->mNext.load(std::memory_order_acquire) == nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void TaskQueue::process(std::chrono::microseconds budget, std::function<bool()> const& stop) {
+  if (empty()) {
+    return;
+  }
+
+  auto                  start = std::chrono::steady_clock::now();
+  std::function<void()> task;
+
+  while (pop(task)) {
+    try {
+      task();
+    } catch (std::exception const& e) {
+      logger().error("Failed to execute task: {}", e.what());
+    }
+
+    if (std::chrono::steady_clock::now() - start >= budget || (stop && stop())) {
+      return;
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void TaskQueue::clear() {
+  std::function<void()> task;
+  while (pop(task)) {
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool TaskQueue::pop(std::function<void()>& task) {
+  Node* next = mTail->mNext.load(std::memory_order_acquire);
+  if (!next) {
+    return false;
+  }
+
+  // The next node becomes the new dummy, so its task is moved out.
+  task        = std::move(next->mTask);
+  next->mTask = nullptr;
+  delete mTail;
+  mTail = next;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
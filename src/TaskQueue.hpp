@@ -0,0 +1,91 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_TASK_QUEUE_HPP
+#define CSP_WEB_API_TASK_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <memory>
+#include <type_traits>
+
+namespace csp::webapi {
+
+/// The server threads use this queue to hand work over to the main thread. All tasks are executed
+/// in the order in which they were posted, regardless of the endpoint which posted them. This way,
+/// a client can rely on its requests being applied in the order in which it sent them.
+/// The queue is lock-free: Any number of threads may post tasks, but only the main thread may call
+/// empty(), process() and clear(). A task which is being posted concurrently to a call of these
+/// methods may not be seen before the next call.
+class TaskQueue {
+ public:
+  TaskQueue();
+  ~TaskQueue();
+
+  TaskQueue(TaskQueue const& other) = delete;
+  TaskQueue(TaskQueue&& other)      = delete;
+
+  TaskQueue& operator=(TaskQueue const& other) = delete;
+  TaskQueue& operator=(TaskQueue&& other) = delete;
+
+  /// Identifies a posted task, see isLast().
+  using TaskId = void const*;
+
+  /// Appends a task to the queue. Exceptions thrown by the task are logged. This is thread-safe.
+  TaskId post(std::function<void()> task);
+
+  /// Returns true if no other task has been posted after the given one. This can be used to merge
+  /// a request into a pending task without changing the order of execution. The identifiers of
+  /// executed tasks may be reused, so the result is only meaningful as long as the given task has
+  /// not been executed. This is thread-safe.
+  bool isLast(TaskId task) const;
+
+  /// Appends a task to the queue and returns a future for its result. Exceptions thrown by the
+  /// task are stored in the future. If the task is dropped by clear(), the future reports a broken
+  /// promise. This is thread-safe.
+  template <typename F>
+  std::future<std::invoke_result_t<F>> submit(F&& task) {
+    // std::function requires a copyable callable, so the packaged task is shared.
+    auto packaged = std::make_shared<std::packaged_task<std::invoke_result_t<F>()>>(
+        std::forward<F>(task));
+    auto result = packaged->get_future();
+    post([packaged]() { (*packaged)(); });
+    return result;
+  }
+
+  /// Returns true if there are no pending tasks. This is a single atomic load.
+  bool empty() const;
+
+  /// Executes the pending tasks in FIFO order until the queue is empty or the given time budget is
+  /// exhausted. If a stop function is given, it is called after each task and processing ends as
+  /// soon as it returns true. At least one task is executed if the queue is not empty. The
+  /// remaining tasks stay in the queue for the next call.
+  void process(std::chrono::microseconds budget, std::function<bool()> const& stop = {});
+
+  /// Drops all pending tasks without executing them.
+  void clear();
+
+ private:
+  struct Node {
+    std::atomic<Node*>    mNext{nullptr};
+    std::function<void()> mTask;
+  };
+
+  /// Removes the oldest task from the queue. Returns false if there is none.
+  bool pop(std::function<void()>& task);
+
+  // This is an intrusive singly-linked list. Producers append their nodes by exchanging mHead,
+  // the main thread removes nodes at mTail. The node mTail points to is always a dummy whose task
+  // has already been taken, so the list is never empty and producers never touch mTail.
+  std::atomic<Node*> mHead;
+  Node*              mTail;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_TASK_QUEUE_HPP
@@ -0,0 +1,72 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include "ThreadPool.hpp"
+
+#include "logger.hpp"
+
+namespace csp::webapi {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ThreadPool::ThreadPool(size_t threadCount) {
+  for (size_t i(0); i < threadCount; ++i) {
+    mThreads.emplace_back([this]() {
+      while (true) {
+        std::function<void()> task;
+
+        {
+          std::unique_lock<std::mutex> lock(mMutex);
+          mCondition.wait(lock, [this]() { return mStop || !mTasks.empty(); });
+
+          // We only quit once all remaining tasks have been processed.
+          if (mTasks.empty()) {
+            return;
+          }
+
+          task = std::move(mTasks.front());
+          mTasks.pop();
+        }
+
+        try {
+          task();
+        } catch (std::exception const& e) {
+          logger().error("Failed to execute task: {}", e.what());
+        }
+      }
+    });
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStop = true;
+  }
+
+  mCondition.notify_all();
+
+  for (auto& thread : mThreads) {
+    thread.join();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+void ThreadPool::enqueue(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTasks.push(std::move(task));
+  }
+
+  mCondition.notify_one();
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace csp::webapi
@@ -0,0 +1,47 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CSP_WEB_API_THREAD_POOL_HPP
+#define CSP_WEB_API_THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace csp::webapi {
+
+/// A very simple pool of worker threads which execute enqueued tasks in FIFO order. This is used
+/// to move expensive work like image encoding away from the main thread.
+class ThreadPool {
+ public:
+  explicit ThreadPool(size_t threadCount);
+
+  /// Executes all remaining tasks and joins the worker threads.
+  ~ThreadPool();
+
+  ThreadPool(ThreadPool const& other) = delete;
+  ThreadPool(ThreadPool&& other)      = delete;
+
+  ThreadPool& operator=(ThreadPool const& other) = delete;
+  ThreadPool& operator=(ThreadPool&& other) = delete;
+
+  /// Schedules the given task for execution on one of the worker threads. This is thread-safe.
+  void enqueue(std::function<void()> task);
+
+ private:
+  std::vector<std::thread>          mThreads;
+  std::queue<std::function<void()>> mTasks;
+  std::mutex                        mMutex;
+  std::condition_variable           mCondition;
+  bool                              mStop = false;
+};
+
+} // namespace csp::webapi
+
+#endif // CSP_WEB_API_THREAD_POOL_HPP
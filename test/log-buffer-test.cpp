@@ -0,0 +1,131 @@
+////////////////////////////////////////////////////////////////////////////////////////////////////
+//                               This file is part of CosmoScout VR                               //
+//      and may be used under the terms of the MIT license. See the LICENSE file for details.     //
+//                        Copyright: (c) 2019 German Aerospace Center (DLR)                       //
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// These tests check the LogBuffer of the csp-web-api plugin. They do not require a running
+// CosmoScout VR instance. The executable returns a non-zero exit code if any check fails.
+
+#include "../src/LogBuffer.hpp"
+
+#include <array>
+#include <iostream>
+#include <string>
+
+namespace {
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+int gFailures = 0;
+
+// Prints the given message and counts a failure if the condition is false.
+void check(bool condition, std::string const& message) {
+  if (!condition) {
+    std::cerr << "FAILED: " << message << std::endl;
+    ++gFailures;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Returns true if the given string consists of complete UTF-8 sequences only.
+bool isValidUTF8(std::string const& string) {
+  size_t i = 0;
+  while (i < string.size()) {
+    auto   byte   = static_cast<unsigned char>(string[i]);
+    size_t length = byte < 0x80U ? 1 : (byte >> 5U) == 0x6U ? 2 : (byte >> 4U) == 0xEU ? 3 : 4;
+
+    if (i + length > string.size()) {
+      return false;
+    }
+
+    for (size_t j(1); j < length; ++j) {
+      if ((static_cast<unsigned char>(string[i + j]) & 0xC0U) != 0x80U) {
+        return false;
+      }
+    }
+
+    i += length;
+  }
+
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Messages longer than a slot must not be cut in the middle of a multi-byte sequence. Otherwise,
+// serializing them to JSON would throw.
+void testMultiByteTruncation() {
+  csp::webapi::LogBuffer buffer(4);
+
+  // These code points are encoded with two, three and four bytes. The prefix shifts the sequences
+  // against the slot size, so that each of the possible cut positions is tested.
+  std::array<std::string, 3> characters{"\xC3\xA4", "\xE2\x82\xAC", "\xF0\x9F\x8C\x8D"};
+
+  for (auto const& character : characters) {
+    for (size_t offset(0); offset < character.size(); ++offset) {
+      std::string message(offset, 'x');
+      while (message.size() <= csp::webapi::LogBuffer::MAX_MESSAGE_LENGTH) {
+        message += character;
+      }
+
+      std::string logger(offset, 'x');
+      while (logger.size() <= csp::webapi::LogBuffer::MAX_LOGGER_LENGTH) {
+        logger += character;
+      }
+
+      buffer.add(logger, spdlog::level::info, message);
+
+      auto entries = buffer.getLatest(1);
+      check(entries.size() == 1, "One entry is returned.");
+      if (entries.empty()) {
+        continue;
+      }
+
+      auto const& entry = entries.front();
+      check(entry.mMessage.size() <= csp::webapi::LogBuffer::MAX_MESSAGE_LENGTH,
+          "The message is truncated.");
+      check(entry.mMessage.size() + character.size() > csp::webapi::LogBuffer::MAX_MESSAGE_LENGTH,
+          "The message is truncated by less than one code point.");
+      check(isValidUTF8(entry.mMessage), "The truncated message is valid UTF-8.");
+      check(isValidUTF8(entry.mLogger), "The truncated logger name is valid UTF-8.");
+
+      try {
+        nlohmann::json(entries).dump();
+      } catch (std::exception const& e) {
+        check(false, std::string("The entry can be serialized: ") + e.what());
+      }
+    }
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Messages which fit into a slot are stored unchanged.
+void testShortMessages() {
+  csp::webapi::LogBuffer buffer(4);
+  buffer.add("logger", spdlog::level::warn, "Gr\xC3\xBC\xC3\x9F" "e");
+
+  auto entries = buffer.getLatest(1);
+  check(entries.size() == 1 && entries.front().mMessage == "Gr\xC3\xBC\xC3\x9F" "e" &&
+            entries.front().mLogger == "logger",
+      "Short messages are stored unchanged.");
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+} // namespace
+
+int main() {
+  testMultiByteTruncation();
+  testShortMessages();
+
+  if (gFailures > 0) {
+    std::cerr << gFailures << " checks failed." << std::endl;
+    return 1;
+  }
+
+  std::cout << "All checks passed." << std::endl;
+  return 0;
+}